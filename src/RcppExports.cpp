@@ -10,6 +10,95 @@ Rcpp::Rostream<true>&  Rcpp::Rcout = Rcpp::Rcpp_cout_get();
 Rcpp::Rostream<false>& Rcpp::Rcerr = Rcpp::Rcpp_cerr_get();
 #endif
 
+// Cfits_gz_extname_to_ext
+int Cfits_gz_extname_to_ext(Rcpp::String filename, Rcpp::String extname);
+RcppExport SEXP _Rfits_Cfits_gz_extname_to_ext(SEXP filenameSEXP, SEXP extnameSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< Rcpp::String >::type extname(extnameSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_gz_extname_to_ext(filename, extname));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_gunzip_file
+void Cfits_gunzip_file(Rcpp::String filename, Rcpp::String destname);
+RcppExport SEXP _Rfits_Cfits_gunzip_file(SEXP filenameSEXP, SEXP destnameSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< Rcpp::String >::type destname(destnameSEXP);
+    Cfits_gunzip_file(filename, destname);
+    return R_NilValue;
+END_RCPP
+}
+// Cfits_string_hash
+std::string Cfits_string_hash(Rcpp::String x);
+RcppExport SEXP _Rfits_Cfits_string_hash(SEXP xSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type x(xSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_string_hash(x));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_disk_free
+double Cfits_disk_free(Rcpp::String path);
+RcppExport SEXP _Rfits_Cfits_disk_free(SEXP pathSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type path(pathSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_disk_free(path));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_raw_register
+void Cfits_raw_register(Rcpp::String filename, Rcpp::RawVector data, bool copy);
+RcppExport SEXP _Rfits_Cfits_raw_register(SEXP filenameSEXP, SEXP dataSEXP, SEXP copySEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< Rcpp::RawVector >::type data(dataSEXP);
+    Rcpp::traits::input_parameter< bool >::type copy(copySEXP);
+    Cfits_raw_register(filename, data, copy);
+    return R_NilValue;
+END_RCPP
+}
+// Cfits_raw_exists
+bool Cfits_raw_exists(Rcpp::String filename);
+RcppExport SEXP _Rfits_Cfits_raw_exists(SEXP filenameSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_raw_exists(filename));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_raw_get
+Rcpp::RawVector Cfits_raw_get(Rcpp::String filename);
+RcppExport SEXP _Rfits_Cfits_raw_get(SEXP filenameSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_raw_get(filename));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_raw_drop
+void Cfits_raw_drop(Rcpp::String filename);
+RcppExport SEXP _Rfits_Cfits_raw_drop(SEXP filenameSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Cfits_raw_drop(filename);
+    return R_NilValue;
+END_RCPP
+}
 // Cfits_create_header
 void Cfits_create_header(Rcpp::String filename, int create_ext, int create_file);
 RcppExport SEXP _Rfits_Cfits_create_header(SEXP filenameSEXP, SEXP create_extSEXP, SEXP create_fileSEXP) {
@@ -147,6 +236,24 @@ BEGIN_RCPP
     return R_NilValue;
 END_RCPP
 }
+// Cfits_write_header
+void Cfits_write_header(Rcpp::String filename, Rcpp::CharacterVector keynames, Rcpp::List keyvalues, Rcpp::CharacterVector keycomments, Rcpp::IntegerVector typecodes, Rcpp::CharacterVector comment, Rcpp::CharacterVector history, int ext, int skip_existing);
+RcppExport SEXP _Rfits_Cfits_write_header(SEXP filenameSEXP, SEXP keynamesSEXP, SEXP keyvaluesSEXP, SEXP keycommentsSEXP, SEXP typecodesSEXP, SEXP commentSEXP, SEXP historySEXP, SEXP extSEXP, SEXP skip_existingSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type keynames(keynamesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type keyvalues(keyvaluesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type keycomments(keycommentsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type typecodes(typecodesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type comment(commentSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type history(historySEXP);
+    Rcpp::traits::input_parameter< int >::type ext(extSEXP);
+    Rcpp::traits::input_parameter< int >::type skip_existing(skip_existingSEXP);
+    Cfits_write_header(filename, keynames, keyvalues, keycomments, typecodes, comment, history, ext, skip_existing);
+    return R_NilValue;
+END_RCPP
+}
 // Cfits_write_history
 void Cfits_write_history(Rcpp::String filename, Rcpp::String history, int ext);
 RcppExport SEXP _Rfits_Cfits_write_history(SEXP filenameSEXP, SEXP historySEXP, SEXP extSEXP) {
@@ -220,8 +327,8 @@ BEGIN_RCPP
 END_RCPP
 }
 // Cfits_read_img
-SEXP Cfits_read_img(Rcpp::String filename, int ext, int datatype, long naxis1, long naxis2, long naxis3, long naxis4);
-RcppExport SEXP _Rfits_Cfits_read_img(SEXP filenameSEXP, SEXP extSEXP, SEXP datatypeSEXP, SEXP naxis1SEXP, SEXP naxis2SEXP, SEXP naxis3SEXP, SEXP naxis4SEXP) {
+SEXP Cfits_read_img(Rcpp::String filename, int ext, int datatype, long naxis1, long naxis2, long naxis3, long naxis4, int blank, int force_logical, int use_bad, double bad);
+RcppExport SEXP _Rfits_Cfits_read_img(SEXP filenameSEXP, SEXP extSEXP, SEXP datatypeSEXP, SEXP naxis1SEXP, SEXP naxis2SEXP, SEXP naxis3SEXP, SEXP naxis4SEXP, SEXP blankSEXP, SEXP force_logicalSEXP, SEXP use_badSEXP, SEXP badSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -232,7 +339,11 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< long >::type naxis2(naxis2SEXP);
     Rcpp::traits::input_parameter< long >::type naxis3(naxis3SEXP);
     Rcpp::traits::input_parameter< long >::type naxis4(naxis4SEXP);
-    rcpp_result_gen = Rcpp::wrap(Cfits_read_img(filename, ext, datatype, naxis1, naxis2, naxis3, naxis4));
+    Rcpp::traits::input_parameter< int >::type blank(blankSEXP);
+    Rcpp::traits::input_parameter< int >::type force_logical(force_logicalSEXP);
+    Rcpp::traits::input_parameter< int >::type use_bad(use_badSEXP);
+    Rcpp::traits::input_parameter< double >::type bad(badSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_read_img(filename, ext, datatype, naxis1, naxis2, naxis3, naxis4, blank, force_logical, use_bad, bad));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -260,6 +371,158 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// Cfits_read_hdu_dir
+Rcpp::DataFrame Cfits_read_hdu_dir(Rcpp::String filename);
+RcppExport SEXP _Rfits_Cfits_read_hdu_dir(SEXP filenameSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_read_hdu_dir(filename));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_read_all_headers
+Rcpp::List Cfits_read_all_headers(Rcpp::String filename, int remove_HIERARCH);
+RcppExport SEXP _Rfits_Cfits_read_all_headers(SEXP filenameSEXP, SEXP remove_HIERARCHSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< int >::type remove_HIERARCH(remove_HIERARCHSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_read_all_headers(filename, remove_HIERARCH));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_read_all_hdus
+Rcpp::List Cfits_read_all_hdus(Rcpp::String filename, int anycompress, int remove_HIERARCH, int cores, int blank);
+RcppExport SEXP _Rfits_Cfits_read_all_hdus(SEXP filenameSEXP, SEXP anycompressSEXP, SEXP remove_HIERARCHSEXP, SEXP coresSEXP, SEXP blankSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< int >::type anycompress(anycompressSEXP);
+    Rcpp::traits::input_parameter< int >::type remove_HIERARCH(remove_HIERARCHSEXP);
+    Rcpp::traits::input_parameter< int >::type cores(coresSEXP);
+    Rcpp::traits::input_parameter< int >::type blank(blankSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_read_all_hdus(filename, anycompress, remove_HIERARCH, cores, blank));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_write_all_hdus
+void Cfits_write_all_hdus(Rcpp::String filename, Rcpp::List hdus, int cores);
+RcppExport SEXP _Rfits_Cfits_write_all_hdus(SEXP filenameSEXP, SEXP hdusSEXP, SEXP coresSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type hdus(hdusSEXP);
+    Rcpp::traits::input_parameter< int >::type cores(coresSEXP);
+    Cfits_write_all_hdus(filename, hdus, cores);
+    return R_NilValue;
+END_RCPP
+}
+// Cfits_read_keys
+Rcpp::List Cfits_read_keys(Rcpp::String filename, Rcpp::CharacterVector keynames, int ext);
+RcppExport SEXP _Rfits_Cfits_read_keys(SEXP filenameSEXP, SEXP keynamesSEXP, SEXP extSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type keynames(keynamesSEXP);
+    Rcpp::traits::input_parameter< int >::type ext(extSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_read_keys(filename, keynames, ext));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_header_index
+SEXP Cfits_header_index(Rcpp::String filename, int ext);
+RcppExport SEXP _Rfits_Cfits_header_index(SEXP filenameSEXP, SEXP extSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< int >::type ext(extSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_header_index(filename, ext));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_header_index_valid
+bool Cfits_header_index_valid(SEXP index);
+RcppExport SEXP _Rfits_Cfits_header_index_valid(SEXP indexSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type index(indexSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_header_index_valid(index));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_header_index_keys
+Rcpp::List Cfits_header_index_keys(SEXP index, Rcpp::CharacterVector keynames);
+RcppExport SEXP _Rfits_Cfits_header_index_keys(SEXP indexSEXP, SEXP keynamesSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type keynames(keynamesSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_header_index_keys(index, keynames));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_header_index_list
+SEXP Cfits_header_index_list(SEXP index);
+RcppExport SEXP _Rfits_Cfits_header_index_list(SEXP indexSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type index(indexSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_header_index_list(index));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_key_scan
+Rcpp::List Cfits_key_scan(Rcpp::CharacterVector filelist, Rcpp::IntegerVector extlist, Rcpp::CharacterVector extnames, Rcpp::CharacterVector keylist, int get_length, int get_dim, int cores);
+RcppExport SEXP _Rfits_Cfits_key_scan(SEXP filelistSEXP, SEXP extlistSEXP, SEXP extnamesSEXP, SEXP keylistSEXP, SEXP get_lengthSEXP, SEXP get_dimSEXP, SEXP coresSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type filelist(filelistSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type extlist(extlistSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type extnames(extnamesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type keylist(keylistSEXP);
+    Rcpp::traits::input_parameter< int >::type get_length(get_lengthSEXP);
+    Rcpp::traits::input_parameter< int >::type get_dim(get_dimSEXP);
+    Rcpp::traits::input_parameter< int >::type cores(coresSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_key_scan(filelist, extlist, extnames, keylist, get_length, get_dim, cores));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_read_header_list
+SEXP Cfits_read_header_list(Rcpp::String filename, int ext, int remove_HIERARCH);
+RcppExport SEXP _Rfits_Cfits_read_header_list(SEXP filenameSEXP, SEXP extSEXP, SEXP remove_HIERARCHSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< int >::type ext(extSEXP);
+    Rcpp::traits::input_parameter< int >::type remove_HIERARCH(remove_HIERARCHSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_read_header_list(filename, ext, remove_HIERARCH));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_parse_header
+SEXP Cfits_parse_header(Rcpp::CharacterVector header, int nkey, int remove_HIERARCH);
+RcppExport SEXP _Rfits_Cfits_parse_header(SEXP headerSEXP, SEXP nkeySEXP, SEXP remove_HIERARCHSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type header(headerSEXP);
+    Rcpp::traits::input_parameter< int >::type nkey(nkeySEXP);
+    Rcpp::traits::input_parameter< int >::type remove_HIERARCH(remove_HIERARCHSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_parse_header(header, nkey, remove_HIERARCH));
+    return rcpp_result_gen;
+END_RCPP
+}
 // Cfits_delete_HDU
 void Cfits_delete_HDU(Rcpp::String filename, int ext);
 RcppExport SEXP _Rfits_Cfits_delete_HDU(SEXP filenameSEXP, SEXP extSEXP) {
@@ -294,9 +557,65 @@ BEGIN_RCPP
     return R_NilValue;
 END_RCPP
 }
+// Cfits_edit_header
+void Cfits_edit_header(Rcpp::String filename, int ext, Rcpp::CharacterVector keynames, Rcpp::List keyvalues, Rcpp::CharacterVector keycomments, Rcpp::IntegerVector typecodes, Rcpp::CharacterVector delete_keynames, Rcpp::CharacterVector comment, Rcpp::CharacterVector history, int write_date, int write_chksum);
+RcppExport SEXP _Rfits_Cfits_edit_header(SEXP filenameSEXP, SEXP extSEXP, SEXP keynamesSEXP, SEXP keyvaluesSEXP, SEXP keycommentsSEXP, SEXP typecodesSEXP, SEXP delete_keynamesSEXP, SEXP commentSEXP, SEXP historySEXP, SEXP write_dateSEXP, SEXP write_chksumSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< int >::type ext(extSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type keynames(keynamesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type keyvalues(keyvaluesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type keycomments(keycommentsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type typecodes(typecodesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type delete_keynames(delete_keynamesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type comment(commentSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type history(historySEXP);
+    Rcpp::traits::input_parameter< int >::type write_date(write_dateSEXP);
+    Rcpp::traits::input_parameter< int >::type write_chksum(write_chksumSEXP);
+    Cfits_edit_header(filename, ext, keynames, keyvalues, keycomments, typecodes, delete_keynames, comment, history, write_date, write_chksum);
+    return R_NilValue;
+END_RCPP
+}
+// Cfits_gzip_index
+int Cfits_gzip_index(Rcpp::String filename, Rcpp::String index_file, double span);
+RcppExport SEXP _Rfits_Cfits_gzip_index(SEXP filenameSEXP, SEXP index_fileSEXP, SEXP spanSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< Rcpp::String >::type index_file(index_fileSEXP);
+    Rcpp::traits::input_parameter< double >::type span(spanSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_gzip_index(filename, index_file, span));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_gzip_index_load
+bool Cfits_gzip_index_load(Rcpp::String filename, Rcpp::String index_file);
+RcppExport SEXP _Rfits_Cfits_gzip_index_load(SEXP filenameSEXP, SEXP index_fileSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< Rcpp::String >::type index_file(index_fileSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_gzip_index_load(filename, index_file));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_gzip_index_available
+bool Cfits_gzip_index_available(Rcpp::String filename);
+RcppExport SEXP _Rfits_Cfits_gzip_index_available(SEXP filenameSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_gzip_index_available(filename));
+    return rcpp_result_gen;
+END_RCPP
+}
 // Cfits_read_img_subset
-SEXP Cfits_read_img_subset(Rcpp::String filename, int ext, int datatype, long fpixel0, long fpixel1, long fpixel2, long fpixel3, long lpixel0, long lpixel1, long lpixel2, long lpixel3, long sparse);
-RcppExport SEXP _Rfits_Cfits_read_img_subset(SEXP filenameSEXP, SEXP extSEXP, SEXP datatypeSEXP, SEXP fpixel0SEXP, SEXP fpixel1SEXP, SEXP fpixel2SEXP, SEXP fpixel3SEXP, SEXP lpixel0SEXP, SEXP lpixel1SEXP, SEXP lpixel2SEXP, SEXP lpixel3SEXP, SEXP sparseSEXP) {
+SEXP Cfits_read_img_subset(Rcpp::String filename, int ext, int datatype, long fpixel0, long fpixel1, long fpixel2, long fpixel3, long lpixel0, long lpixel1, long lpixel2, long lpixel3, long sparse, int blank);
+RcppExport SEXP _Rfits_Cfits_read_img_subset(SEXP filenameSEXP, SEXP extSEXP, SEXP datatypeSEXP, SEXP fpixel0SEXP, SEXP fpixel1SEXP, SEXP fpixel2SEXP, SEXP fpixel3SEXP, SEXP lpixel0SEXP, SEXP lpixel1SEXP, SEXP lpixel2SEXP, SEXP lpixel3SEXP, SEXP sparseSEXP, SEXP blankSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -312,7 +631,8 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< long >::type lpixel2(lpixel2SEXP);
     Rcpp::traits::input_parameter< long >::type lpixel3(lpixel3SEXP);
     Rcpp::traits::input_parameter< long >::type sparse(sparseSEXP);
-    rcpp_result_gen = Rcpp::wrap(Cfits_read_img_subset(filename, ext, datatype, fpixel0, fpixel1, fpixel2, fpixel3, lpixel0, lpixel1, lpixel2, lpixel3, sparse));
+    Rcpp::traits::input_parameter< int >::type blank(blankSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_read_img_subset(filename, ext, datatype, fpixel0, fpixel1, fpixel2, fpixel3, lpixel0, lpixel1, lpixel2, lpixel3, sparse, blank));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -338,39 +658,155 @@ BEGIN_RCPP
     return R_NilValue;
 END_RCPP
 }
-// Cfits_write_chksum
-void Cfits_write_chksum(Rcpp::String filename);
-RcppExport SEXP _Rfits_Cfits_write_chksum(SEXP filenameSEXP) {
+// Cfits_lazy_eval
+SEXP Cfits_lazy_eval(Rcpp::List program, int cores);
+RcppExport SEXP _Rfits_Cfits_lazy_eval(SEXP programSEXP, SEXP coresSEXP) {
 BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::List >::type program(programSEXP);
+    Rcpp::traits::input_parameter< int >::type cores(coresSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_lazy_eval(program, cores));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_lazy_reduce
+SEXP Cfits_lazy_reduce(Rcpp::List program, int cores);
+RcppExport SEXP _Rfits_Cfits_lazy_reduce(SEXP programSEXP, SEXP coresSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::List >::type program(programSEXP);
+    Rcpp::traits::input_parameter< int >::type cores(coresSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_lazy_reduce(program, cores));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_lazy_write
+int Cfits_lazy_write(Rcpp::List program, Rcpp::String filename, int bitpix, int create_file, int cores);
+RcppExport SEXP _Rfits_Cfits_lazy_write(SEXP programSEXP, SEXP filenameSEXP, SEXP bitpixSEXP, SEXP create_fileSEXP, SEXP coresSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::List >::type program(programSEXP);
     Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
-    Cfits_write_chksum(filename);
-    return R_NilValue;
+    Rcpp::traits::input_parameter< int >::type bitpix(bitpixSEXP);
+    Rcpp::traits::input_parameter< int >::type create_file(create_fileSEXP);
+    Rcpp::traits::input_parameter< int >::type cores(coresSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_lazy_write(program, filename, bitpix, create_file, cores));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_lazy_stats
+SEXP Cfits_lazy_stats(Rcpp::List program, Rcpp::NumericVector probs, Rcpp::String mask_file, int mask_ext, double compression, int cores);
+RcppExport SEXP _Rfits_Cfits_lazy_stats(SEXP programSEXP, SEXP probsSEXP, SEXP mask_fileSEXP, SEXP mask_extSEXP, SEXP compressionSEXP, SEXP coresSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::List >::type program(programSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type probs(probsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::String >::type mask_file(mask_fileSEXP);
+    Rcpp::traits::input_parameter< int >::type mask_ext(mask_extSEXP);
+    Rcpp::traits::input_parameter< double >::type compression(compressionSEXP);
+    Rcpp::traits::input_parameter< int >::type cores(coresSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_lazy_stats(program, probs, mask_file, mask_ext, compression, cores));
+    return rcpp_result_gen;
 END_RCPP
 }
-// Cfits_verify_chksum
-SEXP Cfits_verify_chksum(Rcpp::String filename, int verbose);
-RcppExport SEXP _Rfits_Cfits_verify_chksum(SEXP filenameSEXP, SEXP verboseSEXP) {
+// Cfits_stack
+int Cfits_stack(Rcpp::CharacterVector filenames, Rcpp::IntegerVector exts, Rcpp::CharacterVector mask_files, Rcpp::IntegerVector mask_exts, Rcpp::NumericVector dim, Rcpp::String method, Rcpp::NumericVector weights, Rcpp::String filename, double clip, int iters, int bitpix, int create_file, int cores);
+RcppExport SEXP _Rfits_Cfits_stack(SEXP filenamesSEXP, SEXP extsSEXP, SEXP mask_filesSEXP, SEXP mask_extsSEXP, SEXP dimSEXP, SEXP methodSEXP, SEXP weightsSEXP, SEXP filenameSEXP, SEXP clipSEXP, SEXP itersSEXP, SEXP bitpixSEXP, SEXP create_fileSEXP, SEXP coresSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type filenames(filenamesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type exts(extsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type mask_files(mask_filesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type mask_exts(mask_extsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type dim(dimSEXP);
+    Rcpp::traits::input_parameter< Rcpp::String >::type method(methodSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type weights(weightsSEXP);
     Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
-    Rcpp::traits::input_parameter< int >::type verbose(verboseSEXP);
-    rcpp_result_gen = Rcpp::wrap(Cfits_verify_chksum(filename, verbose));
+    Rcpp::traits::input_parameter< double >::type clip(clipSEXP);
+    Rcpp::traits::input_parameter< int >::type iters(itersSEXP);
+    Rcpp::traits::input_parameter< int >::type bitpix(bitpixSEXP);
+    Rcpp::traits::input_parameter< int >::type create_file(create_fileSEXP);
+    Rcpp::traits::input_parameter< int >::type cores(coresSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_stack(filenames, exts, mask_files, mask_exts, dim, method, weights, filename, clip, iters, bitpix, create_file, cores));
     return rcpp_result_gen;
 END_RCPP
 }
-// Cfits_get_chksum
-SEXP Cfits_get_chksum(Rcpp::String filename);
-RcppExport SEXP _Rfits_Cfits_get_chksum(SEXP filenameSEXP) {
+// Cfits_crop_box
+Rcpp::IntegerVector Cfits_crop_box(Rcpp::String filename, Rcpp::NumericVector dim, int ext, int crop_na, int crop_inf, int crop_zero, int cores);
+RcppExport SEXP _Rfits_Cfits_crop_box(SEXP filenameSEXP, SEXP dimSEXP, SEXP extSEXP, SEXP crop_naSEXP, SEXP crop_infSEXP, SEXP crop_zeroSEXP, SEXP coresSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
-    rcpp_result_gen = Rcpp::wrap(Cfits_get_chksum(filename));
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type dim(dimSEXP);
+    Rcpp::traits::input_parameter< int >::type ext(extSEXP);
+    Rcpp::traits::input_parameter< int >::type crop_na(crop_naSEXP);
+    Rcpp::traits::input_parameter< int >::type crop_inf(crop_infSEXP);
+    Rcpp::traits::input_parameter< int >::type crop_zero(crop_zeroSEXP);
+    Rcpp::traits::input_parameter< int >::type cores(coresSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_crop_box(filename, dim, ext, crop_na, crop_inf, crop_zero, cores));
     return rcpp_result_gen;
 END_RCPP
 }
+// Cfits_histogram
+Rcpp::List Cfits_histogram(Rcpp::String filename, int ext, std::vector<std::string> cols, std::vector<double> bins, std::vector<double> lo, std::vector<double> hi, Rcpp::String weight, Rcpp::String filter, int bitpix);
+RcppExport SEXP _Rfits_Cfits_histogram(SEXP filenameSEXP, SEXP extSEXP, SEXP colsSEXP, SEXP binsSEXP, SEXP loSEXP, SEXP hiSEXP, SEXP weightSEXP, SEXP filterSEXP, SEXP bitpixSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< int >::type ext(extSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type cols(colsSEXP);
+    Rcpp::traits::input_parameter< std::vector<double> >::type bins(binsSEXP);
+    Rcpp::traits::input_parameter< std::vector<double> >::type lo(loSEXP);
+    Rcpp::traits::input_parameter< std::vector<double> >::type hi(hiSEXP);
+    Rcpp::traits::input_parameter< Rcpp::String >::type weight(weightSEXP);
+    Rcpp::traits::input_parameter< Rcpp::String >::type filter(filterSEXP);
+    Rcpp::traits::input_parameter< int >::type bitpix(bitpixSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_histogram(filename, ext, cols, bins, lo, hi, weight, filter, bitpix));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_checksum_hdus
+Rcpp::DataFrame Cfits_checksum_hdus(Rcpp::String filename, int cores);
+RcppExport SEXP _Rfits_Cfits_checksum_hdus(SEXP filenameSEXP, SEXP coresSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< int >::type cores(coresSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_checksum_hdus(filename, cores));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_verify_files
+Rcpp::DataFrame Cfits_verify_files(Rcpp::CharacterVector filenames, int cores, int stop_on_fail);
+RcppExport SEXP _Rfits_Cfits_verify_files(SEXP filenamesSEXP, SEXP coresSEXP, SEXP stop_on_failSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type filenames(filenamesSEXP);
+    Rcpp::traits::input_parameter< int >::type cores(coresSEXP);
+    Rcpp::traits::input_parameter< int >::type stop_on_fail(stop_on_failSEXP);
+    rcpp_result_gen = Rcpp::wrap(Cfits_verify_files(filenames, cores, stop_on_fail));
+    return rcpp_result_gen;
+END_RCPP
+}
+// Cfits_write_chksum
+void Cfits_write_chksum(Rcpp::String filename);
+RcppExport SEXP _Rfits_Cfits_write_chksum(SEXP filenameSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::String >::type filename(filenameSEXP);
+    Cfits_write_chksum(filename);
+    return R_NilValue;
+END_RCPP
+}
 // Cfits_encode_chksum
 SEXP Cfits_encode_chksum(unsigned long sum, int complement);
 RcppExport SEXP _Rfits_Cfits_encode_chksum(SEXP sumSEXP, SEXP complementSEXP) {
@@ -409,6 +845,14 @@ END_RCPP
 }
 
 static const R_CallMethodDef CallEntries[] = {
+    {"_Rfits_Cfits_gz_extname_to_ext", (DL_FUNC) &_Rfits_Cfits_gz_extname_to_ext, 2},
+    {"_Rfits_Cfits_gunzip_file", (DL_FUNC) &_Rfits_Cfits_gunzip_file, 2},
+    {"_Rfits_Cfits_string_hash", (DL_FUNC) &_Rfits_Cfits_string_hash, 1},
+    {"_Rfits_Cfits_disk_free", (DL_FUNC) &_Rfits_Cfits_disk_free, 1},
+    {"_Rfits_Cfits_raw_register", (DL_FUNC) &_Rfits_Cfits_raw_register, 3},
+    {"_Rfits_Cfits_raw_exists", (DL_FUNC) &_Rfits_Cfits_raw_exists, 1},
+    {"_Rfits_Cfits_raw_get", (DL_FUNC) &_Rfits_Cfits_raw_get, 1},
+    {"_Rfits_Cfits_raw_drop", (DL_FUNC) &_Rfits_Cfits_raw_drop, 1},
     {"_Rfits_Cfits_create_header", (DL_FUNC) &_Rfits_Cfits_create_header, 3},
     {"_Rfits_Cfits_read_col", (DL_FUNC) &_Rfits_Cfits_read_col, 4},
     {"_Rfits_Cfits_read_nrow", (DL_FUNC) &_Rfits_Cfits_read_nrow, 2},
@@ -419,22 +863,46 @@ static const R_CallMethodDef CallEntries[] = {
     {"_Rfits_Cfits_write_col", (DL_FUNC) &_Rfits_Cfits_write_col, 6},
     {"_Rfits_Cfits_read_key", (DL_FUNC) &_Rfits_Cfits_read_key, 4},
     {"_Rfits_Cfits_update_key", (DL_FUNC) &_Rfits_Cfits_update_key, 6},
+    {"_Rfits_Cfits_write_header", (DL_FUNC) &_Rfits_Cfits_write_header, 9},
     {"_Rfits_Cfits_write_history", (DL_FUNC) &_Rfits_Cfits_write_history, 3},
     {"_Rfits_Cfits_write_comment", (DL_FUNC) &_Rfits_Cfits_write_comment, 3},
     {"_Rfits_Cfits_write_date", (DL_FUNC) &_Rfits_Cfits_write_date, 2},
     {"_Rfits_Cfits_create_image", (DL_FUNC) &_Rfits_Cfits_create_image, 10},
     {"_Rfits_Cfits_write_pix", (DL_FUNC) &_Rfits_Cfits_write_pix, 9},
-    {"_Rfits_Cfits_read_img", (DL_FUNC) &_Rfits_Cfits_read_img, 7},
+    {"_Rfits_Cfits_read_img", (DL_FUNC) &_Rfits_Cfits_read_img, 11},
     {"_Rfits_Cfits_read_header", (DL_FUNC) &_Rfits_Cfits_read_header, 2},
     {"_Rfits_Cfits_read_header_raw", (DL_FUNC) &_Rfits_Cfits_read_header_raw, 2},
+    {"_Rfits_Cfits_read_hdu_dir", (DL_FUNC) &_Rfits_Cfits_read_hdu_dir, 1},
+    {"_Rfits_Cfits_read_all_headers", (DL_FUNC) &_Rfits_Cfits_read_all_headers, 2},
+    {"_Rfits_Cfits_read_all_hdus", (DL_FUNC) &_Rfits_Cfits_read_all_hdus, 5},
+    {"_Rfits_Cfits_write_all_hdus", (DL_FUNC) &_Rfits_Cfits_write_all_hdus, 3},
+    {"_Rfits_Cfits_read_keys", (DL_FUNC) &_Rfits_Cfits_read_keys, 3},
+    {"_Rfits_Cfits_header_index", (DL_FUNC) &_Rfits_Cfits_header_index, 2},
+    {"_Rfits_Cfits_header_index_valid", (DL_FUNC) &_Rfits_Cfits_header_index_valid, 1},
+    {"_Rfits_Cfits_header_index_keys", (DL_FUNC) &_Rfits_Cfits_header_index_keys, 2},
+    {"_Rfits_Cfits_header_index_list", (DL_FUNC) &_Rfits_Cfits_header_index_list, 1},
+    {"_Rfits_Cfits_key_scan", (DL_FUNC) &_Rfits_Cfits_key_scan, 7},
+    {"_Rfits_Cfits_read_header_list", (DL_FUNC) &_Rfits_Cfits_read_header_list, 3},
+    {"_Rfits_Cfits_parse_header", (DL_FUNC) &_Rfits_Cfits_parse_header, 3},
     {"_Rfits_Cfits_delete_HDU", (DL_FUNC) &_Rfits_Cfits_delete_HDU, 2},
     {"_Rfits_Cfits_delete_key", (DL_FUNC) &_Rfits_Cfits_delete_key, 3},
     {"_Rfits_Cfits_delete_header", (DL_FUNC) &_Rfits_Cfits_delete_header, 2},
-    {"_Rfits_Cfits_read_img_subset", (DL_FUNC) &_Rfits_Cfits_read_img_subset, 12},
+    {"_Rfits_Cfits_edit_header", (DL_FUNC) &_Rfits_Cfits_edit_header, 11},
+    {"_Rfits_Cfits_gzip_index", (DL_FUNC) &_Rfits_Cfits_gzip_index, 3},
+    {"_Rfits_Cfits_gzip_index_load", (DL_FUNC) &_Rfits_Cfits_gzip_index_load, 2},
+    {"_Rfits_Cfits_gzip_index_available", (DL_FUNC) &_Rfits_Cfits_gzip_index_available, 1},
+    {"_Rfits_Cfits_read_img_subset", (DL_FUNC) &_Rfits_Cfits_read_img_subset, 13},
     {"_Rfits_Cfits_write_img_subset", (DL_FUNC) &_Rfits_Cfits_write_img_subset, 13},
+    {"_Rfits_Cfits_lazy_eval", (DL_FUNC) &_Rfits_Cfits_lazy_eval, 2},
+    {"_Rfits_Cfits_lazy_reduce", (DL_FUNC) &_Rfits_Cfits_lazy_reduce, 2},
+    {"_Rfits_Cfits_lazy_write", (DL_FUNC) &_Rfits_Cfits_lazy_write, 5},
+    {"_Rfits_Cfits_lazy_stats", (DL_FUNC) &_Rfits_Cfits_lazy_stats, 6},
+    {"_Rfits_Cfits_stack", (DL_FUNC) &_Rfits_Cfits_stack, 13},
+    {"_Rfits_Cfits_crop_box", (DL_FUNC) &_Rfits_Cfits_crop_box, 7},
+    {"_Rfits_Cfits_histogram", (DL_FUNC) &_Rfits_Cfits_histogram, 9},
+    {"_Rfits_Cfits_checksum_hdus", (DL_FUNC) &_Rfits_Cfits_checksum_hdus, 2},
+    {"_Rfits_Cfits_verify_files", (DL_FUNC) &_Rfits_Cfits_verify_files, 3},
     {"_Rfits_Cfits_write_chksum", (DL_FUNC) &_Rfits_Cfits_write_chksum, 1},
-    {"_Rfits_Cfits_verify_chksum", (DL_FUNC) &_Rfits_Cfits_verify_chksum, 2},
-    {"_Rfits_Cfits_get_chksum", (DL_FUNC) &_Rfits_Cfits_get_chksum, 1},
     {"_Rfits_Cfits_encode_chksum", (DL_FUNC) &_Rfits_Cfits_encode_chksum, 2},
     {"_Rfits_Cfits_decode_chksum", (DL_FUNC) &_Rfits_Cfits_decode_chksum, 2},
     {"_Rfits_Cfits_read_nkey", (DL_FUNC) &_Rfits_Cfits_read_nkey, 2},
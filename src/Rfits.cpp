@@ -1,10 +1,63 @@
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <iomanip>
 #include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <Rcpp.h>
 
 #include "cfitsio/fitsio.h"
+#include <zlib.h>
+
+// internal cfitsio routines (see fitsio2.h): ffiblk grows a header by several
+// blocks with a single shift of the rest of the file, ffparsecompspec applies a
+// [compress ...] specification to an open handle, the *e histogram routines are
+// the versions of fits_calc_binning/fits_make_hist taking expressions, and
+// fits_register_driver adds the in-memory rfitsraw:// driver
+extern "C" int ffiblk(fitsfile *fptr, long nblock, int headdata, int *status);
+#define fits_insert_blocks ffiblk
+extern "C" int ffparsecompspec(fitsfile *fptr, char *compspec, int *status);
+#define fits_parse_compress_spec ffparsecompspec
+extern "C" int fits_calc_binningde(fitsfile *fptr, int naxis, char colname[4][FLEN_VALUE], char *colexpr[4],
+  double *minin, double *maxin, double *binsizein, char minname[4][FLEN_VALUE], char maxname[4][FLEN_VALUE],
+  char binname[4][FLEN_VALUE], int *colnum, int *datatypes, long *haxes, double *amin, double *amax,
+  double *binsize, long *repeat, int *status);
+extern "C" int fits_write_keys_histoe(fitsfile *fptr, fitsfile *histptr, int naxis, int *colnum,
+  char colname[4][FLEN_VALUE], char *colexpr[4], int *status);
+extern "C" int fits_make_histde(fitsfile *fptr, fitsfile *histptr, int *datatypes, int bitpix, int naxis,
+  long *naxes, int *colnum, char *colexpr[4], double *amin, double *amax, double *binsize, double weight,
+  int wtcolnum, char *wtexpr, int recip, char *selectrow, int *status);
+extern "C" int fits_register_driver(char *prefix, int (*init)(void), int (*fitsshutdown)(void),
+  int (*setoptions)(int option), int (*getoptions)(int *options), int (*getversion)(int *version),
+  int (*checkfile)(char *urltype, char *infile, char *outfile),
+  int (*fitsopen)(char *filename, int rwmode, int *driverhandle),
+  int (*fitscreate)(char *filename, int *driverhandle), int (*fitstruncate)(int driverhandle, LONGLONG filesize),
+  int (*fitsclose)(int driverhandle), int (*fremove)(char *filename), int (*size)(int driverhandle, LONGLONG *sizex),
+  int (*flush)(int driverhandle), int (*seek)(int driverhandle, LONGLONG offset),
+  int (*fitsread)(int driverhandle, void *buffer, long nbytes), int (*fitswrite)(int driverhandle, void *buffer, long nbytes));
 
 // Comments with Rcout << something here << std::endl;
 
@@ -20,6 +73,55 @@ std::runtime_error fits_status_to_exception(const char *func_name, int status)
 }
 
 
+/**
+ * Layout of a single HDU, as collected by the HDU directory scan.
+ */
+struct hdu_info {
+  int hdutype = IMAGE_HDU;
+  std::string extname;
+  bool has_extname = false;
+  int extver = 1;
+  int bitpix = 8;
+  bool zimage = false;
+  std::vector<LONGLONG> naxes;
+  LONGLONG headstart = 0;
+  LONGLONG datastart = 0;
+  LONGLONG dataend = 0;
+};
+
+/**
+ * HDU directories are cached per file, and are validated against the file
+ * size and modification time (to the nanosecond where the file system keeps
+ * it) on every lookup. Any handle opened for writing drops the whole cache
+ * when it is closed, so files modified by this package are always rescanned.
+ */
+struct hdu_directory {
+  off_t size;
+  time_t mtime;
+  long mtime_nsec;
+  std::vector<hdu_info> hdus;
+};
+
+static long stat_mtime_nsec(const struct stat &st)
+{
+#if defined(__APPLE__)
+  return st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+  return 0;
+#else
+  return st.st_mtim.tv_nsec;
+#endif
+}
+
+static std::map<std::string, hdu_directory> hdu_directory_cache;
+static std::mutex hdu_directory_mutex;
+
+static void hdu_directory_cache_clear()
+{
+  std::lock_guard<std::mutex> lock(hdu_directory_mutex);
+  hdu_directory_cache.clear();
+}
+
 /**
  * Utility class that takes ownership of a fitsfile pointer
  * and closes it automatically at destruction time.
@@ -33,6 +135,9 @@ public:
   ~fits_file()
   {
     if (m_fptr) {
+      if (m_fptr->Fptr->writemode == READWRITE) {
+        hdu_directory_cache_clear();
+      }
       int status = 0;
       fits_close_file(m_fptr, &status);
     }
@@ -86,6 +191,54 @@ fitsfile *fits_safe_open_file(const char *filename, int mode)
 
 #define fits_invoke(F, ...) _fits_invoke(#F, fits_ ## F, __VA_ARGS__)
 
+/**
+ * Runs fn(0) ... fn(n - 1) over a pool of native threads pulling indices from
+ * a shared counter. The first exception thrown by any task stops the
+ * remaining tasks and is rethrown on the calling thread. fn must not touch
+ * the R API; cfitsio is built reentrant so each task can use its own handle.
+ */
+template <typename F>
+static void parallel_for(std::size_t n, int cores, F &&fn)
+{
+  std::size_t nthreads = std::max(1, std::min<int>(cores, n));
+  if (nthreads == 1) {
+    for (std::size_t ii = 0; ii < n; ii++) {
+      fn(ii);
+    }
+    return;
+  }
+
+  // cfitsio initialises its global lock lazily, so do it before any thread opens a file
+  fits_init_cfitsio();
+
+  std::atomic<std::size_t> next(0);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  std::vector<std::thread> threads;
+  threads.reserve(nthreads);
+  for (std::size_t tt = 0; tt < nthreads; tt++) {
+    threads.emplace_back([&]() {
+      for (auto ii = next++; ii < n; ii = next++) {
+        try {
+          fn(ii);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (!error) {
+            error = std::current_exception();
+          }
+          next = n;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
 std::vector<char *> to_string_vector(const Rcpp::CharacterVector &strings)
 {
   std::vector<char *> c_strings(strings.size());
@@ -115,814 +268,4653 @@ static SEXP ensure_lossless_32bit_int(const std::vector<long> &values)
     return output;
 }
 
-// [[Rcpp::export]]
-void Cfits_create_header(Rcpp::String filename, int create_ext=1, int create_file=1)
+/**
+ * A single parsed header card. Values are kept in the same form the R level
+ * parser (Rfits_hdr_to_keyvalues) has always produced: strings are unquoted
+ * and trimmed (doubled quotes are left as-is), and then whatever R's
+ * as.numeric reads as a number becomes one, quoted or not, with integral
+ * numbers that fit becoming integers. T/F and NA become logicals, again even
+ * when quoted. Fortran D exponents are not numbers to as.numeric, so those
+ * values stay strings.
+ */
+struct header_card {
+  std::string keyname;
+  std::string value;
+  std::string comment;
+  char type = 0; // 'C', 'L', 'I', 'F', 'N' (NA) or 0 if the card carries no key value
+  bool has_comment = false;
+  bool logical = false;
+  int ivalue = 0;
+  double dvalue = 0;
+};
+
+static std::string trim_blanks(const std::string &str)
 {
-  // make empty FITS, useful for just the first header componenet of multi-extension file.
-  int nhdu,hdutype;
-  fits_file fptr;
-  int naxis=0;
-  long *axes = {0};
-  
-  if(create_file == 1){
-    fits_invoke(create_file, fptr, filename.get_cstring());
-    fits_invoke(create_hdu, fptr);
-    fits_invoke(create_img, fptr, 16, naxis, axes);
-  }else{
-    if(create_ext == 1){
-      fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
-      fits_invoke(get_num_hdus, fptr, &nhdu);
-      fits_invoke(movabs_hdu, fptr, nhdu, &hdutype);
-      fits_invoke(create_hdu, fptr);
-    }
+  auto first = str.find_first_not_of(' ');
+  if (first == std::string::npos) {
+    return std::string();
   }
+  auto last = str.find_last_not_of(' ');
+  return str.substr(first, last - first + 1);
 }
-  
-// [[Rcpp::export]]
-SEXP Cfits_read_col(Rcpp::String filename, int colref=1, int ext=2, long nrow=0){
 
-  int hdutype,anynull,typecode,ii;
-  long repeat,width;
+static bool is_comment_card(const std::string &card)
+{
+  return card.compare(0, 8, "COMMENT ") == 0 || card == "COMMENT";
+}
 
-  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READONLY);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-  fits_invoke(get_coltype, fptr, colref, &typecode, &repeat, &width);
-  if(nrow==0){
-    fits_invoke(get_num_rows, fptr, &nrow);
+static bool is_history_card(const std::string &card)
+{
+  return card.compare(0, 8, "HISTORY ") == 0 || card == "HISTORY";
+}
+
+/**
+ * Position of the value indicator of a card carrying a key value, or npos if
+ * it carries none. This only looks at the card layout, so keys can be found
+ * without parsing their values.
+ */
+static std::size_t header_card_equals(const std::string &card)
+{
+  bool hierarch = card.compare(0, 8, "HIERARCH") == 0;
+  if (!(hierarch || (card.size() > 8 && card[8] == '='))) {
+    return std::string::npos;
   }
-  
-  if ( typecode == TSTRING ) {
-    int cwidth;
-    fits_invoke(get_col_display_width, fptr, colref, &cwidth);
+  return card.find('=');
+}
 
-    char **data = (char **)malloc(sizeof(char *) * nrow);
-    for (ii = 0 ; ii < nrow ; ii++ ) {
-      data[ii] = (char*)calloc(cwidth + 1, 1);
-    }
-    fits_invoke(read_col, fptr, TSTRING, colref, 1, 1, nrow, nullptr, data, &anynull);
-    Rcpp::StringVector out(nrow);
-    std::copy(data, data + nrow, out.begin());
-    for (int i = 0; i != nrow; i++) {
-      free(data[i]);
-    }
-    free(data);
+static header_card parse_header_card(const std::string &card, bool remove_HIERARCH=false)
+{
+  header_card out;
+  bool hierarch = card.compare(0, 8, "HIERARCH") == 0;
+  auto eq = header_card_equals(card);
+  if (eq == std::string::npos) {
     return out;
   }
-  else if ( typecode == TBIT ) {
-    int nullval = 0;
-    std::vector<Rbyte> col(nrow);
-    fits_invoke(read_col, fptr, TBIT, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
-    Rcpp::LogicalVector out(nrow);
-    std::copy(col.begin(), col.end(), out.begin());
-    return out;
+  out.keyname = trim_blanks(card.substr(0, eq));
+  if (remove_HIERARCH && hierarch) {
+    out.keyname = trim_blanks(out.keyname.substr(8));
   }
-  else if ( typecode == TLOGICAL ) {
-    int nullval = 0;
-    std::vector<Rbyte> col(nrow);
-    fits_invoke(read_col, fptr, TLOGICAL, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
-    Rcpp::LogicalVector out(nrow);
-    std::copy(col.begin(), col.end(), out.begin());
+
+  char value[FLEN_VALUE], comment[FLEN_COMMENT];
+  int status = 0;
+  fits_parse_value(const_cast<char *>(card.c_str()), value, comment, &status);
+  if (status) {
+    fits_clear_errmsg();
+    out.type = 'C';
+    out.value = trim_blanks(card.substr(eq + 1));
     return out;
   }
-  else if ( typecode == TBYTE ) {
-    int nullval = 0;
-    // std::vector<Rbyte> col(nrow);
-    std::vector<Rbyte> col(nrow);
-    fits_invoke(read_col, fptr, TBYTE, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
-    Rcpp::IntegerVector out(nrow);
-    std::copy(col.begin(), col.end(), out.begin());
+  out.has_comment = card.find(" / ") != std::string::npos;
+  out.comment = comment;
+
+  char dtype = 'C';
+  fits_get_keytype(value, &dtype, &status);
+  if (status) {
+    // undefined value, which R has always seen as an empty string
+    out.type = 'C';
     return out;
   }
-  else if ( typecode == TINT ) {
-    int nullval = -999;
-    std::vector<int> col(nrow);
-    fits_invoke(read_col, fptr, TINT, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
-    Rcpp::IntegerVector out(nrow);
-    std::copy(col.begin(), col.end(), out.begin());
-    return out;
+
+  std::string str = value;
+  if (dtype == 'C') {
+    auto last = str.rfind('\'');
+    str = trim_blanks(str.substr(1, last > 0 ? last - 1 : std::string::npos));
   }
-  else if ( typecode == TUINT ) {
-    unsigned int nullval = 0;
-    std::vector<unsigned int> col(nrow);
-    fits_invoke(read_col, fptr, TUINT, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
-    Rcpp::IntegerVector out(nrow);
-    std::copy(col.begin(), col.end(), out.begin());
-    return out;
+  out.value = str;
+  out.type = 'C';
+
+  if (str == "NA") {
+    out.type = 'N';
   }
-  else if ( typecode == TINT32BIT ) {
-    long nullval = 0;
-    std::vector<long> col(nrow);
-    fits_invoke(read_col, fptr, TINT32BIT, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
-    return ensure_lossless_32bit_int(col);
+  else if (str == "T" || str == "F") {
+    out.type = 'L';
+    out.logical = str == "T";
   }
-  else if ( typecode == TSHORT ) {
-    short nullval = -128;
-    std::vector<short> col(nrow);
-    fits_invoke(read_col, fptr, TSHORT, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
-    Rcpp::IntegerVector out(nrow);
-    std::copy(col.begin(), col.end(), out.begin());
-    return out;
+  else if (!str.empty()) {
+    // as.numeric gives NaN as NA, which R then kept as the string
+    char *end;
+    double number = std::strtod(str.c_str(), &end);
+    if (*end == '\0' && !std::isnan(number)) {
+      if (std::floor(number) == number && std::fabs(number) <= std::numeric_limits<int>::max()) {
+        out.type = 'I';
+        out.ivalue = static_cast<int>(number);
+      }
+      else {
+        out.type = 'F';
+        out.dvalue = number;
+      }
+    }
   }
-  else if ( typecode == TUSHORT ) {
-    unsigned short nullval = 255;
-    std::vector<unsigned short> col(nrow);
-    fits_invoke(read_col, fptr, TUSHORT, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
-    Rcpp::IntegerVector out(nrow);
-    std::copy(col.begin(), col.end(), out.begin());
-    return out;
+  return out;
+}
+
+static SEXP header_card_value(const header_card &card)
+{
+  switch (card.type) {
+  case 'I':
+    return Rcpp::wrap(card.ivalue);
+  case 'F':
+    return Rcpp::wrap(card.dvalue);
+  case 'L':
+    return Rcpp::wrap(card.logical);
+  case 'N':
+    return Rcpp::LogicalVector::create(NA_LOGICAL);
+  default:
+    return Rcpp::wrap(card.value);
   }
-  else if ( typecode == TFLOAT ) {
-    float nullval = -999;
-    std::vector<float> col(nrow);
-    fits_invoke(read_col, fptr, TFLOAT, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
-    Rcpp::NumericVector out(nrow);
-    std::copy(col.begin(), col.end(), out.begin());
-    return out;
+}
+
+/**
+ * Builds the full Rfits_header list (keyvalues, keycomments, keynames,
+ * header, hdr, raw, comment, history, nkey) from raw header cards.
+ */
+static Rcpp::List header_cards_to_list(const std::vector<std::string> &cards, int nkey, bool remove_HIERARCH)
+{
+  std::vector<std::string> comments, histories;
+  std::vector<header_card> parsed;
+  parsed.reserve(cards.size());
+  std::string raw;
+  raw.reserve(cards.size() * 80);
+
+  for (const auto &card : cards) {
+    std::string padded = card.substr(0, 79);
+    padded.resize(80, ' ');
+    raw += padded;
+
+    if (is_comment_card(card)) {
+      comments.push_back(card.size() > 8 ? card.substr(8) : "");
+      continue;
+    }
+    if (is_history_card(card)) {
+      histories.push_back(card.size() > 8 ? card.substr(8) : "");
+      continue;
+    }
+    auto key = parse_header_card(card, remove_HIERARCH);
+    if (key.type) {
+      parsed.push_back(std::move(key));
+    }
   }
-  else if ( typecode == TLONG ) {
-    long nullval = -999;
-    std::vector<long> col(nrow);
-    fits_invoke(read_col, fptr, TLONG, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
-    Rcpp::NumericVector out(nrow);
-    std::copy(col.begin(), col.end(), out.begin());
-    return out;
+
+  auto nparsed = parsed.size();
+  Rcpp::List keyvalues(nparsed), keycomments(nparsed);
+  Rcpp::CharacterVector keynames(nparsed), hdr(2 * nparsed);
+  for (std::size_t ii = 0; ii < nparsed; ii++) {
+    const auto &key = parsed[ii];
+    keynames[ii] = key.keyname;
+    hdr[2 * ii] = key.keyname;
+    hdr[2 * ii + 1] = key.value;
+    keyvalues[ii] = header_card_value(key);
+    if (key.has_comment) {
+      keycomments[ii] = key.comment;
+    }
+    else {
+      keycomments[ii] = Rcpp::CharacterVector::create(NA_STRING);
+    }
   }
-  else if ( typecode == TLONGLONG ) {
-    long nullval = -999;
-    std::vector<int64_t> col(nrow);
-    fits_invoke(read_col, fptr, TLONGLONG, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
-    Rcpp::NumericVector out(nrow);
-    std::memcpy(&(out[0]), &(col[0]), nrow * sizeof(double));
-    out.attr("class") = "integer64";
-    return out;
+  keyvalues.attr("names") = keynames;
+  keyvalues.attr("class") = "Rfits_keylist";
+  keycomments.attr("names") = keynames;
+
+  Rcpp::CharacterVector header(cards.begin(), cards.end());
+  SEXP comment = R_NilValue, history = R_NilValue;
+  if (!comments.empty()) {
+    comment = Rcpp::CharacterVector(comments.begin(), comments.end());
   }
-  else if ( typecode == TDOUBLE ) {
-    double nullval = -999;
-    std::vector<double> col(nrow);
-    fits_invoke(read_col, fptr, TDOUBLE, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
-    Rcpp::NumericVector out(nrow);
-    std::copy(col.begin(), col.end(), out.begin());
-    return out;
+  if (!histories.empty()) {
+    history = Rcpp::CharacterVector(histories.begin(), histories.end());
   }
-  throw std::runtime_error("unsupported type");
-}
-
-// [[Rcpp::export]]
-int Cfits_read_nrow(Rcpp::String filename, int ext=2){
-  int hdutype;
-  long nrow;
 
-  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READONLY);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-  fits_invoke(get_num_rows, fptr, &nrow);
-  return nrow;
+  Rcpp::List out = Rcpp::List::create(
+    Rcpp::Named("keyvalues") = keyvalues,
+    Rcpp::Named("keycomments") = keycomments,
+    Rcpp::Named("keynames") = keynames,
+    Rcpp::Named("header") = header,
+    Rcpp::Named("hdr") = hdr,
+    Rcpp::Named("raw") = raw,
+    Rcpp::Named("comment") = comment,
+    Rcpp::Named("history") = history,
+    Rcpp::Named("nkey") = nkey
+  );
+  out.attr("class") = Rcpp::CharacterVector::create("Rfits_header", "list");
+  return out;
 }
 
-// [[Rcpp::export]]
-int Cfits_read_nhdu(Rcpp::String filename){
-  int nhdu;
+static std::vector<std::string> read_header_cards(fitsfile *fptr, int &nkeys)
+{
+  int keypos;
+  fits_invoke(get_hdrpos, fptr, &nkeys, &keypos);
 
-  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READONLY);
-  fits_invoke(get_num_hdus, fptr, &nhdu);
-  return nhdu;
+  std::vector<std::string> cards(nkeys);
+  char card[FLEN_CARD];
+  for (int ii = 1; ii <= nkeys; ii++) {
+    fits_invoke(read_record, fptr, ii, card);
+    cards[ii - 1] = card;
+  }
+  return cards;
 }
 
-// [[Rcpp::export]]
-int Cfits_read_ncol(Rcpp::String filename, int ext=2){
-  int hdutype,ncol;
-  
-  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READONLY);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-  fits_invoke(get_num_cols, fptr,&ncol);
-  return ncol;
+static bool is_gzip_filename(const std::string &filename)
+{
+  return filename.size() > 3 && filename.compare(filename.size() - 3, 3, ".gz") == 0;
 }
 
-// [[Rcpp::export]]
-SEXP Cfits_read_colname(Rcpp::String filename, int colref=1, int ext=2){
-  int hdutype, ncol;
+/**
+ * A random access index into a gzip file (after zran.c in the zlib examples).
+ * Every span bytes of inflated output we keep a checkpoint: the compressed
+ * and inflated offsets, the bit offset within the compressed byte, and the
+ * last 32KB of output that the inflater needs as its dictionary. Reading from
+ * any offset then only has to inflate from the nearest earlier checkpoint.
+ */
+struct gz_point {
+  long long out;
+  long long in;
+  int bits;
+  std::vector<unsigned char> window;
+};
 
-  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READONLY);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-  fits_invoke(get_num_cols, fptr, &ncol);
+struct gz_index {
+  off_t size;
+  time_t mtime;
+  long long span;
+  std::vector<gz_point> points;
+};
 
-  Rcpp::StringVector out(ncol);
+static const int GZ_WINSIZE = 32768;
+static const int GZ_CHUNK = 16384;
+static const char GZ_INDEX_MAGIC[8] = {'R', 'F', 'G', 'Z', 'I', 'D', 'X', '1'};
 
-  char colname[81];
+static gz_index build_gz_index(const char *filename, long long span)
+{
+  struct stat st;
+  if (stat(filename, &st) != 0) {
+    throw std::runtime_error(std::string("Could not stat ") + filename);
+  }
+  FILE *in = fopen(filename, "rb");
+  if (!in) {
+    throw std::runtime_error(std::string("Could not open ") + filename);
+  }
 
-  int status = 0;
-  int ii = 0;
-  while ( status != COL_NOT_FOUND & ii < ncol) {
-    fits_get_colname(fptr, CASEINSEN, (char *)"*", (char *)colname, &colref, &status);
-    if (status != COL_NOT_FOUND) {
-      out[ii] = colname;
+  gz_index index {st.st_size, st.st_mtime, span, {}};
+  std::vector<unsigned char> input(GZ_CHUNK), window(GZ_WINSIZE);
+  z_stream strm = {};
+  // 47 = 15 bit window, with the gzip or zlib header detected automatically
+  if (inflateInit2(&strm, 47) != Z_OK) {
+    fclose(in);
+    throw std::runtime_error("Could not initialise zlib");
+  }
+
+  long long totin = 0, totout = 0, last = 0;
+  int ret = Z_OK;
+  strm.avail_out = 0;
+  do {
+    strm.avail_in = fread(input.data(), 1, GZ_CHUNK, in);
+    if (ferror(in) || strm.avail_in == 0) {
+      ret = Z_DATA_ERROR;
+      break;
     }
-    ii++;
+    strm.next_in = input.data();
+    do {
+      if (strm.avail_out == 0) {
+        strm.avail_out = GZ_WINSIZE;
+        strm.next_out = window.data();
+      }
+      totin += strm.avail_in;
+      totout += strm.avail_out;
+      ret = inflate(&strm, Z_BLOCK);
+      totin -= strm.avail_in;
+      totout -= strm.avail_out;
+      if (ret == Z_NEED_DICT || ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) {
+        ret = Z_DATA_ERROR;
+        break;
+      }
+      if (ret == Z_STREAM_END) {
+        break;
+      }
+      // at the end of a deflate block (but not the last) we can restart
+      if ((strm.data_type & 128) && !(strm.data_type & 64) && (totout == 0 || totout - last > span)) {
+        gz_point point {totout, totin, strm.data_type & 7, std::vector<unsigned char>(GZ_WINSIZE)};
+        unsigned left = strm.avail_out;
+        if (left) {
+          std::memcpy(point.window.data(), window.data() + GZ_WINSIZE - left, left);
+        }
+        if (left < GZ_WINSIZE) {
+          std::memcpy(point.window.data() + left, window.data(), GZ_WINSIZE - left);
+        }
+        index.points.push_back(std::move(point));
+        last = totout;
+      }
+    } while (strm.avail_in != 0);
+  } while (ret != Z_STREAM_END && ret != Z_DATA_ERROR);
+
+  bool trailing = ret == Z_STREAM_END && (strm.avail_in != 0 || fgetc(in) != EOF);
+  inflateEnd(&strm);
+  fclose(in);
+  if (ret != Z_STREAM_END) {
+    throw std::runtime_error(std::string("Could not index corrupt or truncated gzip file ") + filename);
   }
-  return out;
+  if (trailing) {
+    throw std::runtime_error(std::string("Cannot index multi-member gzip file ") + filename);
+  }
+  return index;
 }
 
-// [[Rcpp::export]]
-void Cfits_create_bintable(Rcpp::String filename, int tfields,
-                         Rcpp::CharacterVector ttypes, Rcpp::CharacterVector tforms,
-                         Rcpp::CharacterVector tunits, Rcpp::String extname, int ext=2,
-                         int create_ext=1, int create_file=1, int table_type=2)
+/**
+ * Reads len inflated bytes from offset into buf, returning the number of
+ * bytes actually read (fewer at the end of the file).
+ */
+static size_t gz_index_read(const char *filename, const gz_index &index, long long offset,
+                            unsigned char *buf, size_t len)
 {
-  auto c_ttypes = to_string_vector(ttypes);
-  auto c_tforms = to_string_vector(tforms);
-  auto c_tunits = to_string_vector(tunits);
+  if (len == 0 || index.points.empty()) {
+    return 0;
+  }
+  auto here = std::upper_bound(index.points.begin(), index.points.end(), offset,
+                               [](long long value, const gz_point &point) { return value < point.out; });
+  if (here != index.points.begin()) {
+    --here;
+  }
 
-  int nhdu, hdutype;
-  
-  fits_file fptr;
-  
-  if(create_file == 1){
-    fits_invoke(create_file, fptr, filename.get_cstring());
-    fits_invoke(create_hdu, fptr);
-  }else{
-    fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
-    if(create_ext == 1){
-      fits_invoke(get_num_hdus, fptr, &nhdu);
-      fits_invoke(movabs_hdu, fptr, nhdu, &hdutype);
-      fits_invoke(create_hdu, fptr);
-    }else{
-      fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-      fits_invoke(delete_hdu, fptr, &hdutype);
+  FILE *in = fopen(filename, "rb");
+  if (!in) {
+    throw std::runtime_error(std::string("Could not open ") + filename);
+  }
+  z_stream strm = {};
+  inflateInit2(&strm, -15);
+  bool ok = fseeko(in, here->in - (here->bits ? 1 : 0), SEEK_SET) == 0;
+  if (ok && here->bits) {
+    int ch = fgetc(in);
+    ok = ch != EOF && inflatePrime(&strm, here->bits, ch >> (8 - here->bits)) == Z_OK;
+  }
+  ok = ok && inflateSetDictionary(&strm, here->window.data(), GZ_WINSIZE) == Z_OK;
+
+  std::vector<unsigned char> input(GZ_CHUNK), discard(GZ_WINSIZE);
+  long long skip = offset - here->out;
+  bool skipping = true;
+  int ret = Z_OK;
+  strm.avail_in = 0;
+  while (ok && skipping) {
+    if (skip == 0) {
+      strm.avail_out = len;
+      strm.next_out = buf;
+      skipping = false;
+    }
+    else {
+      long long step = std::min<long long>(skip, GZ_WINSIZE);
+      strm.avail_out = step;
+      strm.next_out = discard.data();
+      skip -= step;
+    }
+    do {
+      if (strm.avail_in == 0) {
+        strm.avail_in = fread(input.data(), 1, GZ_CHUNK, in);
+        if (ferror(in) || strm.avail_in == 0) {
+          ok = false;
+          break;
+        }
+        strm.next_in = input.data();
+      }
+      ret = inflate(&strm, Z_NO_FLUSH);
+      if (ret == Z_NEED_DICT || ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) {
+        ok = false;
+        break;
+      }
+    } while (ret != Z_STREAM_END && strm.avail_out != 0);
+    if (ret == Z_STREAM_END) {
+      break;
     }
   }
-  
-  fits_invoke(create_tbl, fptr, table_type, 0, tfields,
-              c_ttypes.data(), c_tforms.data(), c_tunits.data(),
-              (char *)extname.get_cstring());
+  size_t nread = skipping ? 0 : len - strm.avail_out;
+  inflateEnd(&strm);
+  fclose(in);
+  if (!ok) {
+    throw std::runtime_error(std::string("Could not read from gzip file ") + filename);
+  }
+  return nread;
 }
 
-// [[Rcpp::export]]
-void Cfits_write_col(Rcpp::String filename, SEXP data, int nrow, int colref=1, int ext=2, int typecode=1){
-  int hdutype,ii;
-  
-  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-
-  if ( typecode == TSTRING ) {
-    std::vector<char *> s_data(nrow);
-    for (ii = 0 ; ii < nrow ; ii++ ) {
-      s_data[ii] = (char*)CHAR(STRING_ELT(data, ii));
+static void write_gz_index(const gz_index &index, const std::string &index_file)
+{
+  // write to the side and rename, so readers never see a partial index
+  std::string temp_file = index_file + ".tmp" + std::to_string(getpid());
+  FILE *out = fopen(temp_file.c_str(), "wb");
+  if (!out) {
+    throw std::runtime_error("Could not write gzip index " + index_file);
+  }
+  long long header[4] = {static_cast<long long>(index.size), static_cast<long long>(index.mtime),
+                         index.span, static_cast<long long>(index.points.size())};
+  bool ok = fwrite(GZ_INDEX_MAGIC, 1, 8, out) == 8 && fwrite(header, sizeof(long long), 4, out) == 4;
+  std::vector<unsigned char> packed(compressBound(GZ_WINSIZE));
+  for (const auto &point : index.points) {
+    if (!ok) {
+      break;
     }
-    fits_invoke(write_col, fptr, typecode, colref, 1, 1, nrow, s_data.data());
-  }else if (typecode == TBIT){
-    fits_invoke(write_col, fptr, typecode, colref, 1, 1, nrow, INTEGER(data));
-  }else if (typecode == TINT){
-    fits_invoke(write_col, fptr, typecode, colref, 1, 1, nrow, INTEGER(data));
-  }else if(typecode == TLONGLONG){
-    fits_invoke(write_col, fptr, typecode, colref, 1, 1, nrow, REAL(data));
-  }else if(typecode == TDOUBLE){
-    fits_invoke(write_col, fptr, typecode, colref, 1, 1, nrow, REAL(data));
+    uLongf packed_len = packed.size();
+    ok = compress2(packed.data(), &packed_len, point.window.data(), GZ_WINSIZE, 6) == Z_OK;
+    long long offsets[2] = {point.out, point.in};
+    int meta[2] = {point.bits, static_cast<int>(packed_len)};
+    ok = ok && fwrite(offsets, sizeof(long long), 2, out) == 2 && fwrite(meta, sizeof(int), 2, out) == 2 &&
+      fwrite(packed.data(), 1, packed_len, out) == packed_len;
+  }
+  ok = fclose(out) == 0 && ok;
+  if (!ok || std::rename(temp_file.c_str(), index_file.c_str()) != 0) {
+    std::remove(temp_file.c_str());
+    throw std::runtime_error("Could not write gzip index " + index_file);
   }
 }
 
-// int CFITS_API ffgkey(fitsfile *fptr, const char *keyname, char *keyval, char *comm,
-//                      int *status);
-// 
-// int CFITS_API ffgky( fitsfile *fptr, int datatype, const char *keyname, void *value,
-//                      char *comm, int *status);
-// [[Rcpp::export]]
-SEXP Cfits_read_key(Rcpp::String filename, Rcpp::String keyname, int typecode, int ext=1){
-  int hdutype;
-  
-  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READONLY);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-  
-  char comment[81];
-  
-  if ( typecode == TDOUBLE ) {
-    Rcpp::NumericVector out(1);
-    std::vector<double> keyvalue(1);
-    fits_invoke(read_key, fptr, TDOUBLE, keyname.get_cstring(), keyvalue.data(), comment);
-    std::copy(keyvalue.begin(), keyvalue.end(), out.begin());
-    return(out);
-  }else if ( typecode == TSTRING){
-    Rcpp::StringVector out(1);
-    //std::vector<std::string> keyvalue(1);
-    char keyvalue[81];
-    fits_invoke(read_key, fptr, TSTRING, keyname.get_cstring(), keyvalue, comment);
-    out[0] = keyvalue;
-    //std::copy(keyvalue.begin(), keyvalue.end(), out.begin());
-    return(out);
-  }else if ( typecode == TLONG ) {
-    Rcpp::IntegerVector out(1);
-    std::vector<int> keyvalue(1);
-    fits_invoke(read_key, fptr, TLONG, keyname.get_cstring(), keyvalue.data(), comment);
-    std::copy(keyvalue.begin(), keyvalue.end(), out.begin());
-    return(out);
+/**
+ * Loads an index written by write_gz_index. Returns false if the file is
+ * missing, is not an index, or was built from a different version of the
+ * gzip file (by size and modification time).
+ */
+static bool read_gz_index(const std::string &index_file, const struct stat &gz_st, gz_index &index)
+{
+  FILE *in = fopen(index_file.c_str(), "rb");
+  if (!in) {
+    return false;
   }
-  throw std::runtime_error("unsupported type");
+  char magic[8];
+  long long header[4];
+  bool ok = fread(magic, 1, 8, in) == 8 && std::memcmp(magic, GZ_INDEX_MAGIC, 8) == 0 &&
+    fread(header, sizeof(long long), 4, in) == 4 && header[0] == gz_st.st_size && header[1] == gz_st.st_mtime;
+  if (ok) {
+    index = gz_index {static_cast<off_t>(header[0]), static_cast<time_t>(header[1]), header[2], {}};
+    index.points.resize(header[3]);
+    std::vector<unsigned char> packed(compressBound(GZ_WINSIZE));
+    for (auto &point : index.points) {
+      long long offsets[2];
+      int meta[2];
+      ok = fread(offsets, sizeof(long long), 2, in) == 2 && fread(meta, sizeof(int), 2, in) == 2 &&
+        meta[1] > 0 && meta[1] <= static_cast<int>(packed.size()) &&
+        fread(packed.data(), 1, meta[1], in) == static_cast<size_t>(meta[1]);
+      if (!ok) {
+        break;
+      }
+      point.out = offsets[0];
+      point.in = offsets[1];
+      point.bits = meta[0];
+      point.window.resize(GZ_WINSIZE);
+      uLongf window_len = GZ_WINSIZE;
+      ok = uncompress(point.window.data(), &window_len, packed.data(), meta[1]) == Z_OK &&
+        window_len == GZ_WINSIZE;
+      if (!ok) {
+        break;
+      }
+    }
+  }
+  fclose(in);
+  return ok;
 }
 
-// [[Rcpp::export]]
-void Cfits_update_key(Rcpp::String filename, SEXP keyvalue, Rcpp::String keyname,
-                      Rcpp::String keycomment, int ext=1, int typecode=1){
-  int hdutype;
-  
-  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-  
-  if(typecode==TSTRING){
-    char *s_keyvalue;
-    s_keyvalue = (char*)CHAR(STRING_ELT(keyvalue, 0));
-    fits_invoke(update_key, fptr, typecode, keyname.get_cstring(), s_keyvalue, keycomment.get_cstring());
-  }else if (typecode == TINT){
-    fits_invoke(update_key, fptr, typecode, keyname.get_cstring(), INTEGER(keyvalue), keycomment.get_cstring());
-  }else if(typecode == TLONGLONG){
-    fits_invoke(update_key, fptr, typecode, keyname.get_cstring(), REAL(keyvalue), keycomment.get_cstring());
-  }else if(typecode == TDOUBLE){
-    fits_invoke(update_key, fptr, typecode, keyname.get_cstring(), REAL(keyvalue), keycomment.get_cstring());
-  }else if(typecode == TLOGICAL){
-    fits_invoke(update_key, fptr, typecode, keyname.get_cstring(), INTEGER(keyvalue), keycomment.get_cstring());
+/**
+ * Loaded gzip indexes, keyed by gzip file name. An index is used by the
+ * readers below whenever one is registered here or sits next to the gzip
+ * file as <filename>.gzi, and it matches the current gzip file.
+ */
+static std::map<std::string, std::shared_ptr<const gz_index>> gz_index_cache;
+static std::mutex gz_index_mutex;
+
+static std::shared_ptr<const gz_index> get_gz_index(const std::string &filename)
+{
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(gz_index_mutex);
+  auto cached = gz_index_cache.find(filename);
+  if (cached != gz_index_cache.end()) {
+    if (cached->second->size == st.st_size && cached->second->mtime == st.st_mtime) {
+      return cached->second;
+    }
+    gz_index_cache.erase(cached);
+  }
+  auto index = std::make_shared<gz_index>();
+  if (!read_gz_index(filename + ".gzi", st, *index)) {
+    return nullptr;
   }
+  gz_index_cache[filename] = index;
+  return index;
 }
 
-// [[Rcpp::export]]
-void Cfits_write_history(Rcpp::String filename, Rcpp::String history, int ext=1){
-  int hdutype;
-  
-  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-  
-  fits_invoke(write_history, fptr, history.get_cstring());
-}
+/**
+ * Random access to the bytes of a FITS file, used to walk its HDUs without
+ * a cfitsio handle. Reads never go backwards.
+ */
+typedef std::function<size_t(long long offset, unsigned char *buf, size_t len)> fits_byte_reader;
 
-// [[Rcpp::export]]
-void Cfits_write_comment(Rcpp::String filename, Rcpp::String comment, int ext=1){
-  int hdutype;
-  
-  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-  
-  fits_invoke(write_comment, fptr, comment.get_cstring());
+/**
+ * Size in bytes of the data unit described by the given header cards,
+ * including the padding to a whole number of 2880 byte blocks.
+ */
+static long long header_data_size(const std::vector<std::string> &cards)
+{
+  long long bitpix = 0, naxis = 0, pcount = 0, gcount = 1, npix = 1;
+  bool groups = false;
+  std::map<int, long long> naxes;
+  for (const auto &card : cards) {
+    auto key = parse_header_card(card);
+    long long value = key.type == 'F' ? static_cast<long long>(key.dvalue) : key.ivalue;
+    if (key.keyname == "BITPIX") bitpix = value;
+    else if (key.keyname == "NAXIS") naxis = value;
+    else if (key.keyname == "PCOUNT") pcount = value;
+    else if (key.keyname == "GCOUNT") gcount = value;
+    else if (key.keyname == "GROUPS") groups = key.logical;
+    else if (key.keyname.compare(0, 5, "NAXIS") == 0 && (key.type == 'I' || key.type == 'F')) {
+      naxes[std::atoi(key.keyname.c_str() + 5)] = value;
+    }
+  }
+  for (int ii = 1; ii <= naxis; ii++) {
+    // random groups have NAXIS1 = 0, which is not part of the data size
+    if (!(groups && ii == 1)) {
+      npix *= naxes[ii];
+    }
+  }
+  long long datasize = naxis == 0 ? 0 : std::abs(bitpix) / 8 * gcount * (pcount + npix);
+  return (datasize + 2879) / 2880 * 2880;
 }
 
-// [[Rcpp::export]]
-void Cfits_write_date(Rcpp::String filename, int ext=1){
-  int hdutype;
-  
-  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-  
-  fits_invoke(write_date, fptr);
+/**
+ * Reads the header starting at offset through reader into cards, returning
+ * the offset of its data unit, or -1 if the file ends cleanly before it.
+ */
+static long long read_header_at(const fits_byte_reader &reader, long long offset,
+                                std::vector<std::string> &cards)
+{
+  unsigned char block[2880];
+  cards.clear();
+  bool end = false;
+  bool first = true;
+  while (!end) {
+    auto nread = reader(offset, block, sizeof(block));
+    if (nread != sizeof(block)) {
+      if (first && nread == 0) {
+        return -1;
+      }
+      throw std::runtime_error("Reached the end of the file in the middle of a header");
+    }
+    first = false;
+    offset += sizeof(block);
+    for (int ii = 0; ii < 36 && !end; ii++) {
+      std::string card(reinterpret_cast<char *>(block) + ii * 80, 80);
+      if (card.compare(0, 8, "END     ") == 0) {
+        end = true;
+      }
+      else {
+        card.erase(card.find_last_not_of(' ') + 1);
+        cards.push_back(card);
+      }
+    }
+  }
+  // as with cfitsio, blank cards just before END do not count as keys
+  while (!cards.empty() && cards.back().empty()) {
+    cards.pop_back();
+  }
+  return offset;
 }
 
-
-//fitsfile *fptr, int bitpix, int naxis, long *naxes, int *status
-// BYTE_IMG      =   8   ( 8-bit byte pixels, 0 - 255)
-//   SHORT_IMG     =  16   (16 bit integer pixels)
-//   LONG_IMG      =  32   (32-bit integer pixels)
-//   LONGLONG_IMG  =  64   (64-bit integer pixels)
-//   FLOAT_IMG     = -32   (32-bit floating point pixels)
-//   DOUBLE_IMG    = -64   (64-bit floating point pixels)
-//fits_write_pix(fitsfile *fptr, int datatype, long *fpixel,
-//               long nelements, void *array, int *status);
-// [[Rcpp::export]]
-void Cfits_create_image(Rcpp::String filename, int naxis, long naxis1=100 , long naxis2=100, long naxis3=1,
-                        long naxis4=1, int ext=1, int create_ext=1, int create_file=1, int bitpix=32)
+/**
+ * Walks the HDUs of a FITS file through reader, returning the header cards
+ * of HDU ext and the offset of its data unit. Only the headers are read, the
+ * data units are skipped over using the sizes given by their headers. The
+ * cards match what read_header_cards returns for the same HDU.
+ */
+static std::vector<std::string> walk_header_cards(const fits_byte_reader &reader, int ext,
+                                                  int &nkeys, long long &datastart)
 {
-  int hdutype;
-  
-  fits_file fptr;
-  
-  long naxes_vector[] = {naxis1};
-  long naxes_image[] = {naxis1, naxis2};
-  long naxes_cube[] = {naxis1, naxis2, naxis3};
-  long naxes_array[] = {naxis1, naxis2, naxis3, naxis4};
-  long *axes = (naxis == 1) ? naxes_vector : (naxis == 2) ? naxes_image : (naxis == 3 ? naxes_cube : naxes_array);
-  
-  if(create_file == 1){
-    fits_invoke(create_file, fptr, filename.get_cstring());
-    fits_invoke(create_hdu, fptr);
-  }else{
-    fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
-    if(create_ext == 1){
-      int nhdu;
-      fits_invoke(get_num_hdus, fptr, &nhdu);
-      fits_invoke(movabs_hdu, fptr, nhdu, &hdutype);
-      fits_invoke(create_hdu, fptr);
-    }else{
-      fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-      fits_invoke(delete_hdu, fptr, &hdutype);
+  std::vector<std::string> cards;
+  long long offset = 0;
+  for (int hdu = 1; hdu <= ext; hdu++) {
+    datastart = read_header_at(reader, offset, cards);
+    if (datastart < 0) {
+      throw std::runtime_error("Reached the end of the file before finding HDU " + std::to_string(ext));
     }
+    offset = datastart + header_data_size(cards);
   }
-  
-  fits_invoke(create_img, fptr, bitpix, naxis, axes);
+  nkeys = cards.size();
+  return cards;
 }
 
-// [[Rcpp::export]]
-void Cfits_write_pix(Rcpp::String filename, SEXP data, int ext=1, int datatype= -32,
-                     int naxis=2, long naxis1=100 , long naxis2=100, long naxis3=1, long naxis4=1)
+/**
+ * Walks the HDUs of a FITS file through reader until one has the given
+ * EXTNAME, returning its number, or NA if no HDU has it.
+ */
+static int walk_extname(const fits_byte_reader &reader, const std::string &extname)
 {
-  int hdutype, ii, nullvals = 0;
-  long nelements = naxis1 * naxis2 * naxis3 * naxis4;
-  
-  long fpixel_vector[] = {1};
-  long fpixel_image[] = {1, 1};
-  long fpixel_cube[] = {1, 1, 1};
-  long fpixel_array[] = {1, 1, 1, 1};
-  long *fpixel = (naxis == 1) ? fpixel_vector : (naxis == 2) ? fpixel_image : (naxis == 3 ? fpixel_cube : fpixel_array);
-  
-  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-
-  //below need to work for integers and doubles:
-  if(datatype == TBYTE){
-    // char *data_b = (char *)malloc(nelements * sizeof(char));
-    std::vector<Rbyte> data_b(nelements);
-    for (ii = 0; ii < nelements; ii++)  {
-      data_b[ii] = INTEGER(data)[ii];
-    }
-    fits_invoke(write_pix, fptr, datatype, fpixel, nelements, data_b.data());
-  }else if(datatype == TINT){
-    fits_invoke(write_pix, fptr, datatype, fpixel, nelements, INTEGER(data));
-  }else if(datatype == TSHORT){
-    // short *data_s = (short *)malloc(nelements * sizeof(short));
-    std::vector<short> data_s(nelements);
-    for (ii = 0; ii < nelements; ii++)  {
-      data_s[ii] = INTEGER(data)[ii];
-    } 
-    fits_invoke(write_pix, fptr, datatype, fpixel, nelements, data_s.data());
-  }else if(datatype == TLONG){
-    // long *data_l = (long *)malloc(nelements * sizeof(long));
-    std::vector<long> data_l(nelements);
-    for (ii = 0; ii < nelements; ii++)  {
-      data_l[ii] = INTEGER(data)[ii];
+  std::vector<std::string> cards;
+  long long offset = 0;
+  for (int hdu = 1; ; hdu++) {
+    auto datastart = read_header_at(reader, offset, cards);
+    if (datastart < 0) {
+      return NA_INTEGER;
     }
-    fits_invoke(write_pix, fptr, datatype, fpixel, nelements, data_l.data());
-  }else if(datatype == TLONGLONG){
-    fits_invoke(write_pix, fptr, datatype, fpixel, nelements, REAL(data));
-  }else if(datatype == TDOUBLE){
-    fits_invoke(write_pix, fptr, datatype, fpixel, nelements, REAL(data));
-  }else if(datatype == TFLOAT){
-    // float *data_f = (float *)malloc(nelements * sizeof(float));
-    std::vector<float> data_f(nelements);
-    for (ii = 0; ii < nelements; ii++)  {
-      data_f[ii] = REAL(data)[ii];
+    for (const auto &card : cards) {
+      if (card.compare(0, 8, "EXTNAME ") == 0) {
+        auto key = parse_header_card(card);
+        if (key.type && key.value == extname) {
+          return hdu;
+        }
+        break;
+      }
     }
-    fits_invoke(write_pix, fptr, datatype, fpixel, nelements, data_f.data());
+    offset = datastart + header_data_size(cards);
   }
 }
 
-// [[Rcpp::export]]
-SEXP Cfits_read_img(Rcpp::String filename, int ext=1, int datatype= -32,
-                    long naxis1=100, long naxis2=100, long naxis3=1, long naxis4=1)
+/**
+ * Calls walk with a reader over the inflated bytes of a gzipped FITS file.
+ * With an index the reads go through it; without one the gzip is streamed,
+ * inflating only as far as walk reads and throwing away what it skips, so
+ * nothing is written to disk.
+ */
+template <typename Walk>
+static auto with_gz_reader(const char *filename, Walk walk) -> decltype(walk(fits_byte_reader()))
 {
-  int anynull, nullvals = 0, hdutype;
+  auto index = get_gz_index(filename);
+  if (index) {
+    // read ahead, since each indexed read restarts from a checkpoint
+    std::vector<unsigned char> chunk;
+    long long chunk_start = 0;
+    auto reader = [&](long long offset, unsigned char *buf, size_t len) -> size_t {
+      if (offset < chunk_start || offset + static_cast<long long>(len) > chunk_start + static_cast<long long>(chunk.size())) {
+        chunk.resize(std::max<size_t>(len, 1 << 20));
+        chunk_start = offset;
+        chunk.resize(gz_index_read(filename, *index, offset, chunk.data(), chunk.size()));
+      }
+      size_t nread = std::min<long long>(len, chunk_start + static_cast<long long>(chunk.size()) - offset);
+      std::memcpy(buf, chunk.data() + (offset - chunk_start), nread);
+      return nread;
+    };
+    return walk(reader);
+  }
 
-  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READONLY);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  gzFile gz = gzopen(filename, "rb");
+  if (!gz) {
+    throw std::runtime_error(std::string("Could not open gzip file ") + filename);
+  }
+  gzbuffer(gz, 1 << 17);
+  auto reader = [gz](long long offset, unsigned char *buf, size_t len) -> size_t {
+    if (gzseek(gz, offset, SEEK_SET) != offset) {
+      return 0;
+    }
+    int nread = gzread(gz, buf, len);
+    return nread < 0 ? 0 : nread;
+  };
+  try {
+    auto out = walk(reader);
+    gzclose(gz);
+    return out;
+  } catch (...) {
+    gzclose(gz);
+    throw;
+  }
+}
 
-  long nelements = naxis1 * naxis2 * naxis3 * naxis4;
+/**
+ * Header cards of HDU ext of a gzipped FITS file, read without inflating the
+ * file any further than the END card of the target header.
+ */
+static std::vector<std::string> gz_read_header_cards(const char *filename, int ext, int &nkeys,
+                                                     long long &datastart)
+{
+  return with_gz_reader(filename, [&](const fits_byte_reader &reader) {
+    return walk_header_cards(reader, ext, nkeys, datastart);
+  });
+}
 
-  if (datatype==FLOAT_IMG){
-    std::vector<float> pixels(nelements);
-    fits_invoke(read_img, fptr, TFLOAT, 1, nelements, nullptr, pixels.data(), &anynull);
-    Rcpp::NumericVector pixel_matrix(naxis1 * naxis2 * naxis3 * naxis4);
-    std::copy(pixels.begin(), pixels.end(), pixel_matrix.begin());
-    return(pixel_matrix);
-  }else if (datatype==DOUBLE_IMG){
-    std::vector<double> pixels(nelements);
-    fits_invoke(read_img, fptr, TDOUBLE, 1, nelements, nullptr, pixels.data(), &anynull);
-    Rcpp::NumericVector pixel_matrix(naxis1 * naxis2 * naxis3 * naxis4);
-    std::copy(pixels.begin(), pixels.end(), pixel_matrix.begin());
-    return(pixel_matrix);
-  }else if (datatype==BYTE_IMG){
-    //std::vector<char> pixels(nelements);
-    std::vector<Rbyte> pixels(nelements);
-    fits_invoke(read_img, fptr, TBYTE, 1, nelements, &nullvals, pixels.data(), &anynull);
-    Rcpp::IntegerVector pixel_matrix(naxis1 * naxis2 * naxis3 * naxis4);
-    std::copy(pixels.begin(), pixels.end(), pixel_matrix.begin());
-    return(pixel_matrix);
-  }else if (datatype==SHORT_IMG){
-// Weirdly we need to use longs here to deal with the scenario of BZERO making the unsigned short too large
-    std::vector<long> pixels(nelements);
-    fits_invoke(read_img, fptr, TLONG, 1, nelements, &nullvals, pixels.data(), &anynull);
-    Rcpp::IntegerVector pixel_matrix(naxis1 * naxis2 * naxis3 * naxis4);
-    std::copy(pixels.begin(), pixels.end(), pixel_matrix.begin());
-    return(pixel_matrix);
-  }else if (datatype==LONG_IMG){
-    std::vector<long> pixels(nelements);
-    fits_invoke(read_img, fptr, TLONG, 1, nelements, &nullvals, pixels.data(), &anynull);
-    return ensure_lossless_32bit_int(pixels);
-  }else if (datatype==LONGLONG_IMG){
-    std::vector<int64_t> pixels(nelements);
-    fits_invoke(read_img, fptr, TLONGLONG, 1, nelements, &nullvals, pixels.data(), &anynull);
-    Rcpp::NumericVector pixel_matrix(naxis1 * naxis2 * naxis3 * naxis4);
-    std::memcpy(&(pixel_matrix[0]), &(pixels[0]), nelements * sizeof(double));
-    pixel_matrix.attr("class") = "integer64";
-    return(pixel_matrix);
+// [[Rcpp::export]]
+int Cfits_gz_extname_to_ext(Rcpp::String filename, Rcpp::String extname){
+  std::string name = extname.get_cstring();
+  return with_gz_reader(filename.get_cstring(), [&](const fits_byte_reader &reader) {
+    return walk_extname(reader, name);
+  });
+}
+
+/**
+ * Header cards of HDU ext of a file. Gzipped files are read directly (see
+ * gz_read_header_cards) rather than inflated whole by cfitsio.
+ */
+static std::vector<std::string> read_file_header_cards(const char *filename, int ext, int &nkeys)
+{
+  if (is_gzip_filename(filename)) {
+    long long datastart;
+    return gz_read_header_cards(filename, ext, nkeys, datastart);
   }
-  throw std::runtime_error("unsupported type");
+  int hdutype;
+  fits_file fptr = fits_safe_open_file(filename, READONLY);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  return read_header_cards(fptr, nkeys);
 }
 
 // [[Rcpp::export]]
-SEXP Cfits_read_header(Rcpp::String filename, int ext=1){
-  int nkeys, keypos, ii, hdutype;
-  fits_file fptr;
-  fits_invoke(open_image, fptr, filename.get_cstring(), READONLY);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-  fits_invoke(get_hdrpos, fptr, &nkeys, &keypos);
-  
-  Rcpp::StringVector out(nkeys);
-  char card[FLEN_CARD];
-  
-  for (ii = 1; ii <= nkeys; ii++)  {
-    fits_invoke(read_record, fptr, ii, card);
-    out[ii-1] = card;
+void Cfits_gunzip_file(Rcpp::String filename, Rcpp::String destname){
+  gzFile gz = gzopen(filename.get_cstring(), "rb");
+  if (!gz) {
+    throw std::runtime_error(std::string("Could not open gzip file ") + filename.get_cstring());
+  }
+  FILE *out = fopen(destname.get_cstring(), "wb");
+  if (!out) {
+    gzclose(gz);
+    throw std::runtime_error(std::string("Could not create ") + destname.get_cstring());
+  }
+  gzbuffer(gz, 1 << 17);
+  std::vector<char> buffer(1 << 20);
+  int nread;
+  bool ok = true;
+  while (ok && (nread = gzread(gz, buffer.data(), buffer.size())) > 0) {
+    ok = fwrite(buffer.data(), 1, nread, out) == static_cast<size_t>(nread);
+  }
+  ok = ok && nread == 0;
+  gzclose(gz);
+  ok = fclose(out) == 0 && ok;
+  if (!ok) {
+    std::remove(destname.get_cstring());
+    throw std::runtime_error(std::string("Could not gunzip ") + filename.get_cstring());
   }
-  return(out);
 }
 
 // [[Rcpp::export]]
-SEXP Cfits_read_header_raw(Rcpp::String filename, int ext=1){
-  int nkeys, keypos, hdutype;
+std::string Cfits_string_hash(Rcpp::String x){
+  // 64 bit FNV-1a, only used to make stable cache file names
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char *c = x.get_cstring(); *c; c++) {
+    hash = (hash ^ static_cast<unsigned char>(*c)) * 1099511628211ULL;
+  }
+  char out[17];
+  std::snprintf(out, sizeof(out), "%016llx", static_cast<unsigned long long>(hash));
+  return out;
+}
+
+// [[Rcpp::export]]
+double Cfits_disk_free(Rcpp::String path){
+  // bytes available to unprivileged users on the file system holding path, NA if unknown
+#ifndef _WIN32
+  struct statvfs st;
+  if (statvfs(path.get_cstring(), &st) == 0) {
+    return static_cast<double>(st.f_bavail) * st.f_frsize;
+  }
+#endif
+  return NA_REAL;
+}
+
+/**
+ * A cfitsio I/O driver for FITS files held in memory under names like
+ * rfitsraw://name. Unlike cfitsio's own mem:// files these outlive the
+ * handle that made them, so the many open/close cycles of the readers and
+ * writers all see the same bytes. A file is either owned (written by
+ * cfitsio) or borrowed read-only from an R raw vector, which the caller must
+ * keep alive until the file is dropped.
+ */
+struct raw_file {
+  std::vector<char> owned;
+  const char *borrowed = nullptr;
+  size_t borrowed_size = 0;
+  size_t size() const { return borrowed ? borrowed_size : owned.size(); }
+  const char *data() const { return borrowed ? borrowed : owned.data(); }
+};
+
+struct raw_handle {
+  std::string name;
+  LONGLONG pos = 0;
+  bool writable = false;
+  bool open = false;
+};
+
+static std::map<std::string, raw_file> raw_files;
+static std::vector<raw_handle> raw_handles;
+static std::recursive_mutex raw_mutex;
+
+static int raw_new_handle(const std::string &name, bool writable, int *handle)
+{
+  for (size_t ii = 0; ii <= raw_handles.size(); ii++) {
+    if (ii == raw_handles.size()) {
+      raw_handles.emplace_back();
+    }
+    if (!raw_handles[ii].open) {
+      raw_handles[ii] = raw_handle {name, 0, writable, true};
+      *handle = ii;
+      return 0;
+    }
+  }
+  return TOO_MANY_FILES;
+}
+
+static int raw_init() { return 0; }
+static int raw_shutdown() { return 0; }
+static int raw_setoptions(int) { return 0; }
+static int raw_getoptions(int *options) { *options = 0; return 0; }
+static int raw_getversion(int *version) { *version = 10; return 0; }
+
+static int raw_open(char *filename, int rwmode, int *handle)
+{
+  std::lock_guard<std::recursive_mutex> lock(raw_mutex);
+  auto file = raw_files.find(filename);
+  if (file == raw_files.end()) {
+    return FILE_NOT_OPENED;
+  }
+  if (rwmode == READWRITE && file->second.borrowed) {
+    return READONLY_FILE;
+  }
+  return raw_new_handle(filename, rwmode == READWRITE, handle);
+}
+
+static int raw_create(char *filename, int *handle)
+{
+  std::lock_guard<std::recursive_mutex> lock(raw_mutex);
+  raw_files[filename] = raw_file();
+  return raw_new_handle(filename, true, handle);
+}
+
+static int raw_truncate(int handle, LONGLONG filesize)
+{
+  std::lock_guard<std::recursive_mutex> lock(raw_mutex);
+  raw_files[raw_handles[handle].name].owned.resize(filesize, 0);
+  return 0;
+}
+
+static int raw_close(int handle)
+{
+  std::lock_guard<std::recursive_mutex> lock(raw_mutex);
+  raw_handles[handle].open = false;
+  return 0;
+}
+
+static int raw_remove(char *filename)
+{
+  std::lock_guard<std::recursive_mutex> lock(raw_mutex);
+  raw_files.erase(filename);
+  return 0;
+}
+
+static int raw_size(int handle, LONGLONG *filesize)
+{
+  std::lock_guard<std::recursive_mutex> lock(raw_mutex);
+  *filesize = raw_files[raw_handles[handle].name].size();
+  return 0;
+}
+
+static int raw_flush(int) { return 0; }
+
+static int raw_seek(int handle, LONGLONG offset)
+{
+  std::lock_guard<std::recursive_mutex> lock(raw_mutex);
+  if (offset > static_cast<LONGLONG>(raw_files[raw_handles[handle].name].size())) {
+    return END_OF_FILE;
+  }
+  raw_handles[handle].pos = offset;
+  return 0;
+}
+
+static int raw_read(int handle, void *buffer, long nbytes)
+{
+  std::lock_guard<std::recursive_mutex> lock(raw_mutex);
+  auto &file = raw_files[raw_handles[handle].name];
+  auto &pos = raw_handles[handle].pos;
+  if (pos + nbytes > static_cast<LONGLONG>(file.size())) {
+    return END_OF_FILE;
+  }
+  std::memcpy(buffer, file.data() + pos, nbytes);
+  pos += nbytes;
+  return 0;
+}
+
+static int raw_write(int handle, void *buffer, long nbytes)
+{
+  std::lock_guard<std::recursive_mutex> lock(raw_mutex);
+  if (!raw_handles[handle].writable) {
+    return READONLY_FILE;
+  }
+  auto &file = raw_files[raw_handles[handle].name].owned;
+  auto &pos = raw_handles[handle].pos;
+  if (pos + nbytes > static_cast<LONGLONG>(file.size())) {
+    file.resize(pos + nbytes, 0);
+  }
+  std::memcpy(file.data() + pos, buffer, nbytes);
+  pos += nbytes;
+  return 0;
+}
+
+static const std::string RAW_PREFIX = "rfitsraw://";
+
+/**
+ * Name of a raw file in the registry (without its rfitsraw:// prefix),
+ * registering the driver with cfitsio the first time it is needed.
+ */
+static std::string raw_file_name(const std::string &filename)
+{
+  static std::once_flag registered;
+  std::call_once(registered, []() {
+    fits_init_cfitsio();
+    fits_register_driver(const_cast<char *>(RAW_PREFIX.c_str()), raw_init, raw_shutdown, raw_setoptions,
+                         raw_getoptions, raw_getversion, nullptr, raw_open, raw_create, raw_truncate,
+                         raw_close, raw_remove, raw_size, raw_flush, raw_seek, raw_read, raw_write);
+  });
+  if (filename.compare(0, RAW_PREFIX.size(), RAW_PREFIX) != 0) {
+    throw std::runtime_error("Not an in-memory FITS name: " + filename);
+  }
+  return filename.substr(RAW_PREFIX.size());
+}
+
+// [[Rcpp::export]]
+void Cfits_raw_register(Rcpp::String filename, Rcpp::RawVector data, bool copy=false){
+  auto name = raw_file_name(filename.get_cstring());
+  auto bytes = reinterpret_cast<const char *>(RAW(data));
+  std::lock_guard<std::recursive_mutex> lock(raw_mutex);
+  auto &file = raw_files[name];
+  if (copy) {
+    file.owned.assign(bytes, bytes + Rf_xlength(data));
+    file.borrowed = nullptr;
+  }
+  else {
+    file.owned.clear();
+    file.borrowed = bytes;
+    file.borrowed_size = Rf_xlength(data);
+  }
+}
+
+// [[Rcpp::export]]
+bool Cfits_raw_exists(Rcpp::String filename){
+  auto name = raw_file_name(filename.get_cstring());
+  std::lock_guard<std::recursive_mutex> lock(raw_mutex);
+  auto file = raw_files.find(name);
+  return file != raw_files.end() && file->second.size() > 0;
+}
+
+// [[Rcpp::export]]
+Rcpp::RawVector Cfits_raw_get(Rcpp::String filename){
+  auto name = raw_file_name(filename.get_cstring());
+  std::lock_guard<std::recursive_mutex> lock(raw_mutex);
+  auto file = raw_files.find(name);
+  if (file == raw_files.end()) {
+    throw std::runtime_error(std::string("No in-memory FITS file called ") + filename.get_cstring());
+  }
+  Rcpp::RawVector out(file->second.size());
+  std::memcpy(RAW(out), file->second.data(), file->second.size());
+  return out;
+}
+
+// [[Rcpp::export]]
+void Cfits_raw_drop(Rcpp::String filename){
+  auto name = raw_file_name(filename.get_cstring());
+  std::lock_guard<std::recursive_mutex> lock(raw_mutex);
+  raw_files.erase(name);
+}
+
+// [[Rcpp::export]]
+void Cfits_create_header(Rcpp::String filename, int create_ext=1, int create_file=1)
+{
+  // make empty FITS, useful for just the first header componenet of multi-extension file.
+  int nhdu,hdutype;
   fits_file fptr;
-  fits_invoke(open_image, fptr, filename.get_cstring(), READONLY);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-  fits_invoke(get_hdrpos, fptr, &nkeys, &keypos);
-  
-  Rcpp::StringVector out(1);
-  
-  char *header = (char *)malloc(FLEN_CARD * nkeys);
-  
-  fits_invoke(hdr2str, fptr, 1, nullptr, 0, &header, &nkeys);
+  int naxis=0;
+  long *axes = {0};
   
-  out[0] = header;
+  if(create_file == 1){
+    fits_invoke(create_file, fptr, filename.get_cstring());
+    fits_invoke(create_hdu, fptr);
+    fits_invoke(create_img, fptr, 16, naxis, axes);
+  }else{
+    if(create_ext == 1){
+      fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
+      fits_invoke(get_num_hdus, fptr, &nhdu);
+      fits_invoke(movabs_hdu, fptr, nhdu, &hdutype);
+      fits_invoke(create_hdu, fptr);
+    }
+  }
+}
   
-  free(header);
+/**
+ * Reads column colref of the table in the current HDU of fptr (the first
+ * nrow rows, or all of them when nrow is 0) into an R vector.
+ */
+static SEXP read_col_data(fitsfile *fptr, int colref, long nrow)
+{
+  int anynull,typecode,ii;
+  long repeat,width;
+
+  fits_invoke(get_coltype, fptr, colref, &typecode, &repeat, &width);
+  if(nrow==0){
+    fits_invoke(get_num_rows, fptr, &nrow);
+  }
   
-  return(out);
-}
+  if ( typecode == TSTRING ) {
+    int cwidth;
+    fits_invoke(get_col_display_width, fptr, colref, &cwidth);
 
-// [[Rcpp::export]]
-void Cfits_delete_HDU(Rcpp::String filename, int ext=1){
-  int hdutype;
-  fits_file fptr;
-  fits_invoke(open_image, fptr, filename.get_cstring(), READWRITE);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-  fits_invoke(delete_hdu, fptr, &hdutype);
+    char **data = (char **)malloc(sizeof(char *) * nrow);
+    for (ii = 0 ; ii < nrow ; ii++ ) {
+      data[ii] = (char*)calloc(cwidth + 1, 1);
+    }
+    fits_invoke(read_col, fptr, TSTRING, colref, 1, 1, nrow, nullptr, data, &anynull);
+    Rcpp::StringVector out(nrow);
+    std::copy(data, data + nrow, out.begin());
+    for (int i = 0; i != nrow; i++) {
+      free(data[i]);
+    }
+    free(data);
+    return out;
+  }
+  else if ( typecode == TBIT ) {
+    int nullval = 0;
+    std::vector<Rbyte> col(nrow);
+    fits_invoke(read_col, fptr, TBIT, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
+    Rcpp::LogicalVector out(nrow);
+    std::copy(col.begin(), col.end(), out.begin());
+    return out;
+  }
+  else if ( typecode == TLOGICAL ) {
+    int nullval = 0;
+    std::vector<Rbyte> col(nrow);
+    fits_invoke(read_col, fptr, TLOGICAL, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
+    Rcpp::LogicalVector out(nrow);
+    std::copy(col.begin(), col.end(), out.begin());
+    return out;
+  }
+  else if ( typecode == TBYTE ) {
+    int nullval = 0;
+    // std::vector<Rbyte> col(nrow);
+    std::vector<Rbyte> col(nrow);
+    fits_invoke(read_col, fptr, TBYTE, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
+    Rcpp::IntegerVector out(nrow);
+    std::copy(col.begin(), col.end(), out.begin());
+    return out;
+  }
+  else if ( typecode == TINT ) {
+    int nullval = -999;
+    std::vector<int> col(nrow);
+    fits_invoke(read_col, fptr, TINT, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
+    Rcpp::IntegerVector out(nrow);
+    std::copy(col.begin(), col.end(), out.begin());
+    return out;
+  }
+  else if ( typecode == TUINT ) {
+    unsigned int nullval = 0;
+    std::vector<unsigned int> col(nrow);
+    fits_invoke(read_col, fptr, TUINT, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
+    Rcpp::IntegerVector out(nrow);
+    std::copy(col.begin(), col.end(), out.begin());
+    return out;
+  }
+  else if ( typecode == TINT32BIT ) {
+    long nullval = 0;
+    std::vector<long> col(nrow);
+    fits_invoke(read_col, fptr, TINT32BIT, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
+    return ensure_lossless_32bit_int(col);
+  }
+  else if ( typecode == TSHORT ) {
+    short nullval = -128;
+    std::vector<short> col(nrow);
+    fits_invoke(read_col, fptr, TSHORT, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
+    Rcpp::IntegerVector out(nrow);
+    std::copy(col.begin(), col.end(), out.begin());
+    return out;
+  }
+  else if ( typecode == TUSHORT ) {
+    unsigned short nullval = 255;
+    std::vector<unsigned short> col(nrow);
+    fits_invoke(read_col, fptr, TUSHORT, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
+    Rcpp::IntegerVector out(nrow);
+    std::copy(col.begin(), col.end(), out.begin());
+    return out;
+  }
+  else if ( typecode == TFLOAT ) {
+    float nullval = -999;
+    std::vector<float> col(nrow);
+    fits_invoke(read_col, fptr, TFLOAT, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
+    Rcpp::NumericVector out(nrow);
+    std::copy(col.begin(), col.end(), out.begin());
+    return out;
+  }
+  else if ( typecode == TLONG ) {
+    long nullval = -999;
+    std::vector<long> col(nrow);
+    fits_invoke(read_col, fptr, TLONG, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
+    Rcpp::NumericVector out(nrow);
+    std::copy(col.begin(), col.end(), out.begin());
+    return out;
+  }
+  else if ( typecode == TLONGLONG ) {
+    long nullval = -999;
+    std::vector<int64_t> col(nrow);
+    fits_invoke(read_col, fptr, TLONGLONG, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
+    Rcpp::NumericVector out(nrow);
+    std::memcpy(&(out[0]), &(col[0]), nrow * sizeof(double));
+    out.attr("class") = "integer64";
+    return out;
+  }
+  else if ( typecode == TDOUBLE ) {
+    double nullval = -999;
+    std::vector<double> col(nrow);
+    fits_invoke(read_col, fptr, TDOUBLE, colref, 1, 1, nrow, &nullval, col.data(), &anynull);
+    Rcpp::NumericVector out(nrow);
+    std::copy(col.begin(), col.end(), out.begin());
+    return out;
+  }
+  throw std::runtime_error("unsupported type");
+}
+
+// [[Rcpp::export]]
+SEXP Cfits_read_col(Rcpp::String filename, int colref=1, int ext=2, long nrow=0){
+  int hdutype;
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READONLY);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  return read_col_data(fptr, colref, nrow);
+}
+
+// [[Rcpp::export]]
+int Cfits_read_nrow(Rcpp::String filename, int ext=2){
+  int hdutype;
+  long nrow;
+
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READONLY);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  fits_invoke(get_num_rows, fptr, &nrow);
+  return nrow;
+}
+
+// [[Rcpp::export]]
+int Cfits_read_nhdu(Rcpp::String filename){
+  int nhdu;
+
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READONLY);
+  fits_invoke(get_num_hdus, fptr, &nhdu);
+  return nhdu;
+}
+
+// [[Rcpp::export]]
+int Cfits_read_ncol(Rcpp::String filename, int ext=2){
+  int hdutype,ncol;
+  
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READONLY);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  fits_invoke(get_num_cols, fptr,&ncol);
+  return ncol;
+}
+
+/** Names of all columns of the table in the current HDU of fptr. */
+static Rcpp::StringVector read_colnames(fitsfile *fptr)
+{
+  int ncol, colref;
+  fits_invoke(get_num_cols, fptr, &ncol);
+
+  Rcpp::StringVector out(ncol);
+
+  char colname[81];
+
+  int status = 0;
+  int ii = 0;
+  while ( status != COL_NOT_FOUND & ii < ncol) {
+    fits_get_colname(fptr, CASEINSEN, (char *)"*", (char *)colname, &colref, &status);
+    if (status != COL_NOT_FOUND) {
+      out[ii] = colname;
+    }
+    ii++;
+  }
+  return out;
+}
+
+// [[Rcpp::export]]
+SEXP Cfits_read_colname(Rcpp::String filename, int colref=1, int ext=2){
+  int hdutype;
+
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READONLY);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  return read_colnames(fptr);
+}
+
+// [[Rcpp::export]]
+void Cfits_create_bintable(Rcpp::String filename, int tfields,
+                         Rcpp::CharacterVector ttypes, Rcpp::CharacterVector tforms,
+                         Rcpp::CharacterVector tunits, Rcpp::String extname, int ext=2,
+                         int create_ext=1, int create_file=1, int table_type=2)
+{
+  auto c_ttypes = to_string_vector(ttypes);
+  auto c_tforms = to_string_vector(tforms);
+  auto c_tunits = to_string_vector(tunits);
+
+  int nhdu, hdutype;
+  
+  fits_file fptr;
+  
+  if(create_file == 1){
+    fits_invoke(create_file, fptr, filename.get_cstring());
+    fits_invoke(create_hdu, fptr);
+  }else{
+    fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
+    if(create_ext == 1){
+      fits_invoke(get_num_hdus, fptr, &nhdu);
+      fits_invoke(movabs_hdu, fptr, nhdu, &hdutype);
+      fits_invoke(create_hdu, fptr);
+    }else{
+      fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+      fits_invoke(delete_hdu, fptr, &hdutype);
+    }
+  }
+  
+  fits_invoke(create_tbl, fptr, table_type, 0, tfields,
+              c_ttypes.data(), c_tforms.data(), c_tunits.data(),
+              (char *)extname.get_cstring());
+}
+
+/**
+ * Writes the first nrow rows of column colref of the table in the current HDU
+ * of fptr from an R vector, with typecode giving the cfitsio type.
+ */
+static void write_col_data(fitsfile *fptr, SEXP data, int nrow, int colref, int typecode)
+{
+  int ii;
+
+  if ( typecode == TSTRING ) {
+    std::vector<char *> s_data(nrow);
+    for (ii = 0 ; ii < nrow ; ii++ ) {
+      s_data[ii] = (char*)CHAR(STRING_ELT(data, ii));
+    }
+    fits_invoke(write_col, fptr, typecode, colref, 1, 1, nrow, s_data.data());
+  }else if (typecode == TBIT){
+    fits_invoke(write_col, fptr, typecode, colref, 1, 1, nrow, INTEGER(data));
+  }else if (typecode == TINT){
+    fits_invoke(write_col, fptr, typecode, colref, 1, 1, nrow, INTEGER(data));
+  }else if(typecode == TLONGLONG){
+    fits_invoke(write_col, fptr, typecode, colref, 1, 1, nrow, REAL(data));
+  }else if(typecode == TDOUBLE){
+    fits_invoke(write_col, fptr, typecode, colref, 1, 1, nrow, REAL(data));
+  }
+}
+
+// [[Rcpp::export]]
+void Cfits_write_col(Rcpp::String filename, SEXP data, int nrow, int colref=1, int ext=2, int typecode=1){
+  int hdutype;
+  
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+
+  write_col_data(fptr, data, nrow, colref, typecode);
+}
+
+// int CFITS_API ffgkey(fitsfile *fptr, const char *keyname, char *keyval, char *comm,
+//                      int *status);
+// 
+// int CFITS_API ffgky( fitsfile *fptr, int datatype, const char *keyname, void *value,
+//                      char *comm, int *status);
+// [[Rcpp::export]]
+SEXP Cfits_read_key(Rcpp::String filename, Rcpp::String keyname, int typecode, int ext=1){
+  int hdutype;
+  
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READONLY);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  
+  char comment[81];
+  
+  if ( typecode == TDOUBLE ) {
+    Rcpp::NumericVector out(1);
+    std::vector<double> keyvalue(1);
+    fits_invoke(read_key, fptr, TDOUBLE, keyname.get_cstring(), keyvalue.data(), comment);
+    std::copy(keyvalue.begin(), keyvalue.end(), out.begin());
+    return(out);
+  }else if ( typecode == TSTRING){
+    Rcpp::StringVector out(1);
+    //std::vector<std::string> keyvalue(1);
+    char keyvalue[81];
+    fits_invoke(read_key, fptr, TSTRING, keyname.get_cstring(), keyvalue, comment);
+    out[0] = keyvalue;
+    //std::copy(keyvalue.begin(), keyvalue.end(), out.begin());
+    return(out);
+  }else if ( typecode == TLONG ) {
+    Rcpp::IntegerVector out(1);
+    std::vector<int> keyvalue(1);
+    fits_invoke(read_key, fptr, TLONG, keyname.get_cstring(), keyvalue.data(), comment);
+    std::copy(keyvalue.begin(), keyvalue.end(), out.begin());
+    return(out);
+  }
+  throw std::runtime_error("unsupported type");
+}
+
+static void update_key_value(fitsfile *fptr, SEXP keyvalue, const char *keyname,
+                             const char *keycomment, int typecode)
+{
+  if(typecode==TSTRING){
+    char *s_keyvalue;
+    s_keyvalue = (char*)CHAR(STRING_ELT(keyvalue, 0));
+    fits_invoke(update_key, fptr, typecode, keyname, s_keyvalue, keycomment);
+  }else if (typecode == TINT){
+    fits_invoke(update_key, fptr, typecode, keyname, INTEGER(keyvalue), keycomment);
+  }else if(typecode == TLONGLONG){
+    fits_invoke(update_key, fptr, typecode, keyname, REAL(keyvalue), keycomment);
+  }else if(typecode == TDOUBLE){
+    fits_invoke(update_key, fptr, typecode, keyname, REAL(keyvalue), keycomment);
+  }else if(typecode == TLOGICAL){
+    fits_invoke(update_key, fptr, typecode, keyname, INTEGER(keyvalue), keycomment);
+  }
+}
+
+// [[Rcpp::export]]
+void Cfits_update_key(Rcpp::String filename, SEXP keyvalue, Rcpp::String keyname,
+                      Rcpp::String keycomment, int ext=1, int typecode=1){
+  int hdutype;
+  
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  
+  update_key_value(fptr, keyvalue, keyname.get_cstring(), keycomment.get_cstring(), typecode);
+}
+
+/**
+ * Number of header records a key will need once written, allowing for long
+ * strings being continued over several CONTINUE cards.
+ */
+static long key_record_count(SEXP keyvalue, int typecode)
+{
+  if (typecode != TSTRING || TYPEOF(keyvalue) != STRSXP || Rf_xlength(keyvalue) < 1) {
+    return 1;
+  }
+  long len = std::strlen(CHAR(STRING_ELT(keyvalue, 0)));
+  return len <= 68 ? 1 : 1 + (len - 68 + 66) / 67;
+}
+
+/**
+ * Number of COMMENT/HISTORY records a line of text needs, as cfitsio splits
+ * long text over several 72 character cards.
+ */
+static long text_record_count(const std::string &text)
+{
+  long len = text.size();
+  return len <= 72 ? 1 : (len + 71) / 72;
+}
+
+/**
+ * Writes a whole header into the current HDU of fptr. Header space is reserved
+ * up front so cfitsio does not have to shift the data unit as the header grows:
+ * an HDU just created by fptr (fresh) still has an undefined data start, so
+ * fits_set_hdrsize can place it, while for an HDU read from disk the blocks
+ * still missing are inserted in one go. Keys already present in the HDU (or
+ * with a Z prefix, as in tile compressed images) are left alone when
+ * skip_existing is set. Keys that fail to write are reported in a single
+ * warning rather than aborting the whole header.
+ */
+static void write_header_keys(fitsfile *fptr, Rcpp::CharacterVector keynames, Rcpp::List keyvalues,
+                              Rcpp::CharacterVector keycomments, Rcpp::IntegerVector typecodes,
+                              Rcpp::CharacterVector comment, Rcpp::CharacterVector history,
+                              bool skip_existing, bool fresh)
+{
+  int nkeys, nexist, nmore;
+  
+  std::vector<std::string> existing;
+  if (skip_existing || !fresh) {
+    for (const auto &card : read_header_cards(fptr, nkeys)) {
+      auto key = parse_header_card(card);
+      if (key.type) {
+        existing.push_back(key.keyname);
+      }
+    }
+  }
+  std::sort(existing.begin(), existing.end());
+  auto exists = [&existing](const std::string &keyname) {
+    return std::binary_search(existing.begin(), existing.end(), keyname);
+  };
+  // keynames are compared without the HIERARCH prefix added for long keys
+  auto bare_keyname = [](std::string keyname) {
+    return keyname.compare(0, 8, "HIERARCH") == 0 ? trim_blanks(keyname.substr(8)) : keyname;
+  };
+  auto skipped = [&](const std::string &keyname) {
+    auto bare = bare_keyname(keyname);
+    return skip_existing && (exists(keyname) || exists(bare) || exists("Z" + bare));
+  };
+  
+  // keys already in the header are updated in place, so only need room for any extra CONTINUE cards
+  long needed = 0;
+  for (R_xlen_t ii = 0; ii < keynames.size(); ii++) {
+    std::string keyname = Rcpp::as<std::string>(keynames[ii]);
+    if (!skipped(keyname)) {
+      bool present = exists(keyname) || exists(bare_keyname(keyname));
+      needed += key_record_count(keyvalues[ii], typecodes[ii]) - (present ? 1 : 0);
+    }
+  }
+  for (R_xlen_t ii = 0; ii < comment.size(); ii++) {
+    needed += text_record_count(Rcpp::as<std::string>(comment[ii]));
+  }
+  for (R_xlen_t ii = 0; ii < history.size(); ii++) {
+    needed += text_record_count(Rcpp::as<std::string>(history[ii]));
+  }
+  if (fresh) {
+    fits_invoke(set_hdrsize, fptr, needed);
+  }
+  else {
+    fits_invoke(get_hdrspace, fptr, &nexist, &nmore);
+    if (needed > nmore) {
+      fits_invoke(insert_blocks, fptr, (needed - nmore + 35) / 36, 0);
+    }
+  }
+  
+  std::vector<std::string> failed;
+  for (R_xlen_t ii = 0; ii < keynames.size(); ii++) {
+    std::string keyname = Rcpp::as<std::string>(keynames[ii]);
+    if (skipped(keyname)) {
+      continue;
+    }
+    try {
+      update_key_value(fptr, keyvalues[ii], keyname.c_str(),
+                       Rcpp::as<std::string>(keycomments[ii]).c_str(), typecodes[ii]);
+    } catch (const std::runtime_error &e) {
+      fits_clear_errmsg();
+      failed.push_back(keyname);
+    }
+  }
+  
+  for (R_xlen_t ii = 0; ii < comment.size(); ii++) {
+    fits_invoke(write_comment, fptr, Rcpp::as<std::string>(comment[ii]).c_str());
+  }
+  for (R_xlen_t ii = 0; ii < history.size(); ii++) {
+    fits_invoke(write_history, fptr, Rcpp::as<std::string>(history[ii]).c_str());
+  }
+  
+  if (!failed.empty()) {
+    std::ostringstream os;
+    os << "Failed to write " << failed.size() << " key(s):";
+    for (const auto &keyname : failed) {
+      os << " " << keyname;
+    }
+    Rcpp::warning(os.str());
+  }
+}
+
+// [[Rcpp::export]]
+void Cfits_write_header(Rcpp::String filename, Rcpp::CharacterVector keynames, Rcpp::List keyvalues,
+                        Rcpp::CharacterVector keycomments, Rcpp::IntegerVector typecodes,
+                        Rcpp::CharacterVector comment, Rcpp::CharacterVector history,
+                        int ext=1, int skip_existing=1){
+  int hdutype;
+  
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  
+  write_header_keys(fptr, keynames, keyvalues, keycomments, typecodes, comment, history,
+                    skip_existing == 1, false);
+}
+
+// [[Rcpp::export]]
+void Cfits_write_history(Rcpp::String filename, Rcpp::String history, int ext=1){
+  int hdutype;
+  
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  
+  fits_invoke(write_history, fptr, history.get_cstring());
+}
+
+// [[Rcpp::export]]
+void Cfits_write_comment(Rcpp::String filename, Rcpp::String comment, int ext=1){
+  int hdutype;
+  
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  
+  fits_invoke(write_comment, fptr, comment.get_cstring());
+}
+
+// [[Rcpp::export]]
+void Cfits_write_date(Rcpp::String filename, int ext=1){
+  int hdutype;
+  
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  
+  fits_invoke(write_date, fptr);
+}
+
+
+//fitsfile *fptr, int bitpix, int naxis, long *naxes, int *status
+// BYTE_IMG      =   8   ( 8-bit byte pixels, 0 - 255)
+//   SHORT_IMG     =  16   (16 bit integer pixels)
+//   LONG_IMG      =  32   (32-bit integer pixels)
+//   LONGLONG_IMG  =  64   (64-bit integer pixels)
+//   FLOAT_IMG     = -32   (32-bit floating point pixels)
+//   DOUBLE_IMG    = -64   (64-bit floating point pixels)
+//fits_write_pix(fitsfile *fptr, int datatype, long *fpixel,
+//               long nelements, void *array, int *status);
+// [[Rcpp::export]]
+void Cfits_create_image(Rcpp::String filename, int naxis, long naxis1=100 , long naxis2=100, long naxis3=1,
+                        long naxis4=1, int ext=1, int create_ext=1, int create_file=1, int bitpix=32)
+{
+  int hdutype;
+  
+  fits_file fptr;
+  
+  long naxes_vector[] = {naxis1};
+  long naxes_image[] = {naxis1, naxis2};
+  long naxes_cube[] = {naxis1, naxis2, naxis3};
+  long naxes_array[] = {naxis1, naxis2, naxis3, naxis4};
+  long *axes = (naxis == 1) ? naxes_vector : (naxis == 2) ? naxes_image : (naxis == 3 ? naxes_cube : naxes_array);
+  
+  if(create_file == 1){
+    fits_invoke(create_file, fptr, filename.get_cstring());
+    fits_invoke(create_hdu, fptr);
+  }else{
+    fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
+    if(create_ext == 1){
+      int nhdu;
+      fits_invoke(get_num_hdus, fptr, &nhdu);
+      fits_invoke(movabs_hdu, fptr, nhdu, &hdutype);
+      fits_invoke(create_hdu, fptr);
+    }else{
+      fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+      fits_invoke(delete_hdu, fptr, &hdutype);
+    }
+  }
+  
+  fits_invoke(create_img, fptr, bitpix, naxis, axes);
+}
+
+/**
+ * The pixels of an R vector to be written as an image, captured on the main
+ * thread so that they can be written (and so compressed) without the R API.
+ */
+struct pix_data {
+  int datatype = TFLOAT;
+  int naxis = 0;
+  long nelements = 0;
+  const int *ivalues = nullptr;
+  const double *dvalues = nullptr;
+};
+
+static pix_data get_pix_data(SEXP data, int datatype, int naxis, long nelements)
+{
+  pix_data pix;
+  pix.datatype = datatype;
+  pix.naxis = naxis;
+  pix.nelements = nelements;
+  if (TYPEOF(data) == REALSXP) {
+    pix.dvalues = REAL(data);
+  }
+  else {
+    pix.ivalues = INTEGER(data);
+  }
+  return pix;
+}
+
+/**
+ * Writes pix into the image in the current HDU of fptr. Does not touch the R
+ * API, so it is safe to call from a worker thread.
+ */
+static void write_pix_data(fitsfile *fptr, const pix_data &pix)
+{
+  long ii, nelements = pix.nelements;
+  int datatype = pix.datatype;
+  std::vector<long> fpixel(std::max(pix.naxis, 1), 1);
+
+  //below need to work for integers and doubles:
+  if(datatype == TBYTE){
+    std::vector<Rbyte> data_b(nelements);
+    for (ii = 0; ii < nelements; ii++)  {
+      data_b[ii] = pix.ivalues[ii];
+    }
+    fits_invoke(write_pix, fptr, datatype, fpixel.data(), nelements, data_b.data());
+  }else if(datatype == TINT){
+    fits_invoke(write_pix, fptr, datatype, fpixel.data(), nelements, const_cast<int *>(pix.ivalues));
+  }else if(datatype == TSHORT){
+    std::vector<short> data_s(nelements);
+    for (ii = 0; ii < nelements; ii++)  {
+      data_s[ii] = pix.ivalues[ii];
+    } 
+    fits_invoke(write_pix, fptr, datatype, fpixel.data(), nelements, data_s.data());
+  }else if(datatype == TLONG){
+    std::vector<long> data_l(nelements);
+    for (ii = 0; ii < nelements; ii++)  {
+      data_l[ii] = pix.ivalues[ii];
+    }
+    fits_invoke(write_pix, fptr, datatype, fpixel.data(), nelements, data_l.data());
+  }else if(datatype == TLONGLONG){
+    fits_invoke(write_pix, fptr, datatype, fpixel.data(), nelements, const_cast<double *>(pix.dvalues));
+  }else if(datatype == TDOUBLE){
+    fits_invoke(write_pix, fptr, datatype, fpixel.data(), nelements, const_cast<double *>(pix.dvalues));
+  }else if(datatype == TFLOAT){
+    std::vector<float> data_f(nelements);
+    for (ii = 0; ii < nelements; ii++)  {
+      data_f[ii] = pix.dvalues[ii];
+    }
+    fits_invoke(write_pix, fptr, datatype, fpixel.data(), nelements, data_f.data());
+  }
+}
+
+// [[Rcpp::export]]
+void Cfits_write_pix(Rcpp::String filename, SEXP data, int ext=1, int datatype= -32,
+                     int naxis=2, long naxis1=100 , long naxis2=100, long naxis3=1, long naxis4=1)
+{
+  int hdutype;
+  long nelements = naxis1 * naxis2 * naxis3 * naxis4;
+  
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+
+  write_pix_data(fptr, get_pix_data(data, datatype, naxis, nelements));
+}
+
+/**
+ * An image to be read: the R vector is allocated on the main thread by
+ * alloc_img_data and the pixels are then read straight into it, so the read
+ * itself (read_img_pixels) does not touch the R API. 32 bit images go through
+ * lpixels, since they may need widening to integer64 by finish_img_data.
+ *
+ * Null pixels (BLANK for integers, NaN and Inf for floats) can be mapped as
+ * they are decoded: to NA with blank, or to bad with use_bad. nan_na turns
+ * the NaN of 32 bit floats into NA, and logical returns integers as logical.
+ */
+struct img_read {
+  int hdu = 0;
+  int bitpix = 0;
+  long nelements = 0;
+  double *dpixels = nullptr;
+  int *ipixels = nullptr;
+  std::vector<long> lpixels;
+  bool blank = false;
+  bool nan_na = false;
+  bool logical = false;
+  bool use_bad = false;
+  double bad = 0;
+  double na = 0;
+  int anynull = 0;
+};
+
+static Rcpp::RObject alloc_img_data(img_read &img)
+{
+  img.na = NA_REAL;
+  if (img.bitpix == FLOAT_IMG || img.bitpix == DOUBLE_IMG) {
+    Rcpp::NumericVector pixels(img.nelements);
+    img.dpixels = pixels.begin();
+    return pixels;
+  }else if ((img.bitpix == BYTE_IMG || img.bitpix == SHORT_IMG) && img.logical) {
+    Rcpp::LogicalVector pixels(img.nelements);
+    img.ipixels = pixels.begin();
+    return pixels;
+  }else if (img.bitpix == BYTE_IMG || img.bitpix == SHORT_IMG) {
+    Rcpp::IntegerVector pixels(img.nelements);
+    img.ipixels = pixels.begin();
+    return pixels;
+  }else if (img.bitpix == LONG_IMG) {
+    img.lpixels.resize(img.nelements);
+    return Rcpp::RObject(R_NilValue);
+  }else if (img.bitpix == LONGLONG_IMG) {
+    Rcpp::NumericVector pixels(img.nelements);
+    img.dpixels = pixels.begin();
+    pixels.attr("class") = "integer64";
+    return pixels;
+  }
+  throw std::runtime_error("unsupported type");
+}
+
+// R's NA for integers, and that of bit64 for integer64
+static const int IMG_NA_INTEGER = std::numeric_limits<int>::min();
+static const LONGLONG IMG_NA_INTEGER64 = std::numeric_limits<LONGLONG>::min();
+
+/**
+ * Returns 32 bit pixels as R integers, or as integer64 if any do not fit. The
+ * NA left in null pixels is respelt for integer64 when has_na is set.
+ */
+static SEXP long_img_output(const std::vector<long> &pixels, bool has_na)
+{
+  SEXP output = ensure_lossless_32bit_int(pixels);
+  if (has_na && TYPEOF(output) == REALSXP) {
+    auto values = reinterpret_cast<LONGLONG *>(REAL(output));
+    std::replace(values, values + pixels.size(), (LONGLONG)IMG_NA_INTEGER, IMG_NA_INTEGER64);
+  }
+  return output;
+}
+
+/**
+ * Replaces the null pixels left as na by read_img_pixels with the bad value
+ * (when it is not NA itself), and maps integers to 0/1 for logical output.
+ */
+template <typename T>
+static void map_img_nulls(T *pixels, long nelements, const img_read &img, T na)
+{
+  bool bad = img.use_bad && img.anynull && !std::isnan(img.bad);
+  if (!bad && !img.logical) {
+    return;
+  }
+  for (long ii = 0; ii < nelements; ii++) {
+    if (pixels[ii] == na) {
+      pixels[ii] = bad ? (T)img.bad : na;
+    }
+    else if (img.logical) {
+      pixels[ii] = pixels[ii] != 0;
+    }
+  }
+}
+
+static void read_img_pixels(fitsfile *fptr, img_read &img)
+{
+  int anynull = 0;
+
+  if (img.bitpix == FLOAT_IMG || img.bitpix == DOUBLE_IMG) {
+    // cfitsio maps NaN and Inf to a non-zero nulval as it decodes, but 0 turns the
+    // check off, so a bad value of 0 goes in via NaN
+    double nulval = 0;
+    if (img.use_bad) {
+      nulval = img.bad == 0 ? std::numeric_limits<double>::quiet_NaN() : img.bad;
+    }
+    fits_invoke(read_img, fptr, TDOUBLE, 1, img.nelements, &nulval, img.dpixels, &anynull);
+    if (img.use_bad && img.bad == 0 && anynull) {
+      std::replace_if(img.dpixels, img.dpixels + img.nelements, [](double x) { return std::isnan(x); }, 0.0);
+    }
+    else if (!img.use_bad && img.nan_na && img.bitpix == FLOAT_IMG) {
+      double na = img.na;
+      std::replace_if(img.dpixels, img.dpixels + img.nelements, [](double x) { return std::isnan(x); }, na);
+    }
+  }else if (img.bitpix == BYTE_IMG || img.bitpix == SHORT_IMG) {
+// Reading as int also deals with the scenario of BZERO making the unsigned short too large
+    int nulval = img.blank ? IMG_NA_INTEGER : 0;
+    fits_invoke(read_img, fptr, TINT, 1, img.nelements, &nulval, img.ipixels, &anynull);
+    img.anynull = anynull;
+    map_img_nulls(img.ipixels, img.nelements, img, IMG_NA_INTEGER);
+  }else if (img.bitpix == LONG_IMG) {
+    long nulval = img.blank ? IMG_NA_INTEGER : 0;
+    fits_invoke(read_img, fptr, TLONG, 1, img.nelements, &nulval, img.lpixels.data(), &anynull);
+    img.anynull = anynull;
+    map_img_nulls(img.lpixels.data(), img.nelements, img, (long)IMG_NA_INTEGER);
+  }else if (img.bitpix == LONGLONG_IMG) {
+    LONGLONG nulval = img.blank ? IMG_NA_INTEGER64 : 0;
+    auto pixels = reinterpret_cast<LONGLONG *>(img.dpixels);
+    fits_invoke(read_img, fptr, TLONGLONG, 1, img.nelements, &nulval, pixels, &anynull);
+    img.anynull = anynull;
+    bool logical = img.logical;
+    // integer64 is never returned as logical
+    img.logical = false;
+    map_img_nulls(pixels, img.nelements, img, IMG_NA_INTEGER64);
+    img.logical = logical;
+  }
+}
+
+static SEXP finish_img_data(img_read &img, Rcpp::RObject pixels)
+{
+  if (img.bitpix == LONG_IMG && img.logical) {
+    // already 0/1/NA, so no widening is needed
+    Rcpp::LogicalVector output(img.lpixels.size());
+    std::copy(img.lpixels.begin(), img.lpixels.end(), output.begin());
+    pixels = output;
+    std::vector<long>().swap(img.lpixels);
+  }
+  else if (img.bitpix == LONG_IMG) {
+    pixels = long_img_output(img.lpixels, img.anynull && img.blank);
+    std::vector<long>().swap(img.lpixels);
+  }
+  return pixels;
+}
+
+/**
+ * Reads the first nelements pixels of the image in the current HDU of fptr
+ * into an R vector, with the R type following the BITPIX given as datatype.
+ */
+static SEXP read_img_data(fitsfile *fptr, int datatype, long nelements)
+{
+  img_read img;
+  img.bitpix = datatype;
+  img.nelements = nelements;
+  auto pixels = alloc_img_data(img);
+  read_img_pixels(fptr, img);
+  return finish_img_data(img, pixels);
+}
+
+// [[Rcpp::export]]
+SEXP Cfits_read_img(Rcpp::String filename, int ext=1, int datatype= -32,
+                    long naxis1=100, long naxis2=100, long naxis3=1, long naxis4=1,
+                    int blank=0, int force_logical=0, int use_bad=0, double bad=0)
+{
+  int hdutype;
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READONLY);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+
+  img_read img;
+  img.bitpix = datatype;
+  img.nelements = naxis1 * naxis2 * naxis3 * naxis4;
+  img.blank = blank == 1;
+  img.nan_na = true;
+  img.logical = force_logical == 1;
+  img.use_bad = use_bad == 1;
+  img.bad = bad;
+  auto pixels = alloc_img_data(img);
+  read_img_pixels(fptr, img);
+  return finish_img_data(img, pixels);
+}
+
+// [[Rcpp::export]]
+SEXP Cfits_read_header(Rcpp::String filename, int ext=1){
+  int nkeys, ii;
+  auto cards = read_file_header_cards(filename.get_cstring(), ext, nkeys);
+  
+  Rcpp::StringVector out(nkeys);
+  
+  for (ii = 0; ii < nkeys; ii++)  {
+    out[ii] = cards[ii];
+  }
+  return(out);
+}
+
+// [[Rcpp::export]]
+SEXP Cfits_read_header_raw(Rcpp::String filename, int ext=1){
+  int nkeys, keypos, hdutype;
+  fits_file fptr;
+  fits_invoke(open_image, fptr, filename.get_cstring(), READONLY);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  fits_invoke(get_hdrpos, fptr, &nkeys, &keypos);
+  
+  Rcpp::StringVector out(1);
+  
+  char *header = (char *)malloc(FLEN_CARD * nkeys);
+  
+  fits_invoke(hdr2str, fptr, 1, nullptr, 0, &header, &nkeys);
+  
+  out[0] = header;
+  
+  free(header);
+  
+  return(out);
+}
+
+static bool read_optional_key(fitsfile *fptr, int datatype, const char *keyname, void *value)
+{
+  int status = 0;
+  fits_read_key(fptr, datatype, keyname, value, nullptr, &status);
+  if (status) {
+    fits_clear_errmsg();
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Walks all HDUs of an open file with fits_movrel_hdu, collecting their type,
+ * names, pixel type, dimensions and byte offsets. Tile compressed images are
+ * reported with their uncompressed BITPIX and dimensions (ZBITPIX, ZNAXISn).
+ */
+static std::vector<hdu_info> scan_hdu_directory(fitsfile *fptr)
+{
+  std::vector<hdu_info> hdus;
+  int hdutype;
+  fits_invoke(movabs_hdu, fptr, 1, &hdutype);
+  while (true) {
+    hdu_info hdu;
+    fits_invoke(get_hdu_type, fptr, &hdu.hdutype);
+    fits_invoke(get_hduaddrll, fptr, &hdu.headstart, &hdu.datastart, &hdu.dataend);
+
+    char extname[FLEN_VALUE];
+    hdu.has_extname = read_optional_key(fptr, TSTRING, "EXTNAME", extname);
+    if (hdu.has_extname) {
+      hdu.extname = extname;
+    }
+    read_optional_key(fptr, TINT, "EXTVER", &hdu.extver);
+    int zimage = 0;
+    read_optional_key(fptr, TLOGICAL, "ZIMAGE", &zimage);
+    hdu.zimage = zimage == 1;
+
+    if (hdu.hdutype == IMAGE_HDU) {
+      int naxis;
+      fits_invoke(get_img_type, fptr, &hdu.bitpix);
+      fits_invoke(get_img_dim, fptr, &naxis);
+      hdu.naxes.resize(naxis);
+      if (naxis > 0) {
+        fits_invoke(get_img_sizell, fptr, naxis, hdu.naxes.data());
+      }
+    }
+    else {
+      LONGLONG naxis1 = 0, naxis2 = 0;
+      read_optional_key(fptr, TLONGLONG, "NAXIS1", &naxis1);
+      read_optional_key(fptr, TLONGLONG, "NAXIS2", &naxis2);
+      hdu.naxes = {naxis1, naxis2};
+    }
+    hdus.push_back(std::move(hdu));
+
+    int status = 0;
+    fits_movrel_hdu(fptr, 1, &hdutype, &status);
+    if (status == END_OF_FILE) {
+      fits_clear_errmsg();
+      break;
+    }
+    else if (status) {
+      throw fits_status_to_exception("movrel_hdu", status);
+    }
+  }
+  return hdus;
+}
+
+static std::vector<hdu_info> get_hdu_directory(const std::string &filename)
+{
+  struct stat st;
+  bool cacheable = stat(filename.c_str(), &st) == 0;
+  if (cacheable) {
+    std::lock_guard<std::mutex> lock(hdu_directory_mutex);
+    auto cached = hdu_directory_cache.find(filename);
+    if (cached != hdu_directory_cache.end() && cached->second.size == st.st_size &&
+        cached->second.mtime == st.st_mtime && cached->second.mtime_nsec == stat_mtime_nsec(st)) {
+      return cached->second.hdus;
+    }
+  }
+
+  fits_file fptr = fits_safe_open_file(filename.c_str(), READONLY);
+  auto hdus = scan_hdu_directory(fptr);
+  if (cacheable) {
+    std::lock_guard<std::mutex> lock(hdu_directory_mutex);
+    hdu_directory_cache[filename] = hdu_directory {st.st_size, st.st_mtime, stat_mtime_nsec(st), hdus};
+  }
+  return hdus;
+}
+
+// [[Rcpp::export]]
+Rcpp::DataFrame Cfits_read_hdu_dir(Rcpp::String filename){
+  auto hdus = get_hdu_directory(filename);
+  auto nhdu = hdus.size();
+
+  Rcpp::IntegerVector ext(nhdu), extver(nhdu), bitpix(nhdu), naxis(nhdu);
+  // axis lengths can exceed the integer range (e.g. NAXIS2 of large tables)
+  Rcpp::NumericVector naxis1(nhdu, NA_REAL), naxis2(nhdu, NA_REAL),
+                      naxis3(nhdu, NA_REAL), naxis4(nhdu, NA_REAL);
+  Rcpp::CharacterVector type(nhdu), extname(nhdu);
+  Rcpp::LogicalVector zimage(nhdu);
+  Rcpp::NumericVector headstart(nhdu), datastart(nhdu), datasize(nhdu);
+
+  for (std::size_t ii = 0; ii < nhdu; ii++) {
+    const auto &hdu = hdus[ii];
+    ext[ii] = ii + 1;
+    if (hdu.hdutype == IMAGE_HDU) {
+      type[ii] = "IMAGE";
+    }
+    else if (hdu.hdutype == ASCII_TBL) {
+      type[ii] = "TABLE";
+    }
+    else {
+      type[ii] = "BINTABLE";
+    }
+    if (hdu.has_extname) {
+      extname[ii] = hdu.extname;
+    }
+    else {
+      extname[ii] = NA_STRING;
+    }
+    extver[ii] = hdu.extver;
+    bitpix[ii] = hdu.bitpix;
+    zimage[ii] = hdu.zimage;
+    naxis[ii] = hdu.naxes.size();
+    Rcpp::NumericVector *dims[] = {&naxis1, &naxis2, &naxis3, &naxis4};
+    for (std::size_t jj = 0; jj < hdu.naxes.size() && jj < 4; jj++) {
+      (*dims[jj])[ii] = hdu.naxes[jj];
+    }
+    headstart[ii] = hdu.headstart;
+    datastart[ii] = hdu.datastart;
+    datasize[ii] = hdu.dataend - hdu.datastart;
+  }
+
+  return Rcpp::DataFrame::create(
+    Rcpp::Named("ext") = ext,
+    Rcpp::Named("type") = type,
+    Rcpp::Named("extname") = extname,
+    Rcpp::Named("extver") = extver,
+    Rcpp::Named("bitpix") = bitpix,
+    Rcpp::Named("zimage") = zimage,
+    Rcpp::Named("naxis") = naxis,
+    Rcpp::Named("naxis1") = naxis1,
+    Rcpp::Named("naxis2") = naxis2,
+    Rcpp::Named("naxis3") = naxis3,
+    Rcpp::Named("naxis4") = naxis4,
+    Rcpp::Named("headstart") = headstart,
+    Rcpp::Named("datastart") = datastart,
+    Rcpp::Named("datasize") = datasize,
+    Rcpp::Named("stringsAsFactors") = false
+  );
+}
+
+// [[Rcpp::export]]
+Rcpp::List Cfits_read_all_headers(Rcpp::String filename, int remove_HIERARCH=0){
+  int nkeys, hdutype, nhdu;
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READONLY);
+  fits_invoke(get_num_hdus, fptr, &nhdu);
+  Rcpp::List out(nhdu);
+  for (int ii = 0; ii < nhdu; ii++) {
+    fits_invoke(movabs_hdu, fptr, ii + 1, &hdutype);
+    auto cards = read_header_cards(fptr, nkeys);
+    out[ii] = header_cards_to_list(cards, nkeys, remove_HIERARCH == 1);
+  }
+  return out;
+}
+
+/**
+ * An image HDU found by Cfits_read_all_hdus, kept until its pixels are read.
+ */
+struct pending_img {
+  R_xlen_t index;
+  Rcpp::List header;
+  std::vector<LONGLONG> naxes;
+  Rcpp::RObject pixels;
+  img_read img;
+};
+
+/**
+ * Splits images (in file order) into at most ngroup contiguous runs of about
+ * the same number of bytes, returned as run boundaries.
+ */
+static std::vector<std::size_t> split_img_reads(const std::vector<pending_img> &images, std::size_t ngroup)
+{
+  auto bytes = [](const img_read &img) {
+    return static_cast<double>(img.nelements) * std::abs(img.bitpix) / 8;
+  };
+  double total = 0;
+  for (const auto &image : images) {
+    total += bytes(image.img);
+  }
+  std::vector<std::size_t> bounds(1, 0);
+  double done = 0;
+  for (std::size_t jj = 0; jj < images.size(); jj++) {
+    done += bytes(images[jj].img);
+    if (jj + 1 < images.size() && done >= total * bounds.size() / ngroup) {
+      bounds.push_back(jj + 1);
+    }
+  }
+  bounds.push_back(images.size());
+  return bounds;
+}
+
+/**
+ * Reads every HDU of a file, parsing each header once. Images (including tile
+ * compressed images when anycompress is set) come back with their pixels
+ * (BLANK integer pixels as NA when blank is set, as in Cfits_read_img),
+ * tables with all their columns (a column that cannot be read becomes a single
+ * NA, as in Rfits_read_table), and empty HDUs with just their header.
+ *
+ * With cores = 1 everything is read through one handle in file order. With
+ * more cores the headers and tables are still read that way, but the image
+ * pixels are then read concurrently: each worker opens its own handle and
+ * reads a contiguous run of image HDUs straight into the R vectors allocated
+ * for them here.
+ */
+// [[Rcpp::export]]
+Rcpp::List Cfits_read_all_hdus(Rcpp::String filename, int anycompress=1, int remove_HIERARCH=0, int cores=1,
+                               int blank=1){
+  int nkeys, hdutype, nhdu;
+  std::string name = filename.get_cstring();
+  if (is_gzip_filename(name)) {
+    // every extra handle would inflate the whole file again
+    cores = 1;
+  }
+  fits_file fptr = fits_safe_open_file(name.c_str(), READONLY);
+  fits_invoke(get_num_hdus, fptr, &nhdu);
+  Rcpp::List out(nhdu);
+  std::vector<pending_img> images;
+  for (int ii = 0; ii < nhdu; ii++) {
+    fits_invoke(movabs_hdu, fptr, ii + 1, &hdutype);
+    auto cards = read_header_cards(fptr, nkeys);
+    auto header = header_cards_to_list(cards, nkeys, remove_HIERARCH == 1);
+
+    int zimage = 0;
+    read_optional_key(fptr, TLOGICAL, "ZIMAGE", &zimage);
+    if (hdutype == IMAGE_HDU || (zimage == 1 && anycompress == 1)) {
+      int bitpix, naxis;
+      fits_invoke(get_img_type, fptr, &bitpix);
+      fits_invoke(get_img_dim, fptr, &naxis);
+      if (naxis > 0) {
+        pending_img image;
+        image.index = ii;
+        image.header = header;
+        image.naxes.resize(naxis);
+        fits_invoke(get_img_sizell, fptr, naxis, image.naxes.data());
+        image.img.hdu = ii + 1;
+        image.img.bitpix = bitpix;
+        image.img.blank = blank == 1;
+        image.img.nelements = 1;
+        for (auto naxisn : image.naxes) {
+          image.img.nelements *= naxisn;
+        }
+        image.pixels = alloc_img_data(image.img);
+        if (cores <= 1) {
+          read_img_pixels(fptr, image.img);
+        }
+        images.push_back(std::move(image));
+        continue;
+      }
+    }
+    else if (hdutype == BINARY_TBL || hdutype == ASCII_TBL) {
+      auto colnames = read_colnames(fptr);
+      Rcpp::List columns(colnames.size());
+      for (R_xlen_t jj = 0; jj < colnames.size(); jj++) {
+        try {
+          columns[jj] = read_col_data(fptr, jj + 1, 0);
+        } catch (const std::exception &e) {
+          Rcpp::warning(e.what());
+          columns[jj] = Rcpp::LogicalVector(1, NA_LOGICAL);
+        }
+      }
+      out[ii] = Rcpp::List::create(
+        Rcpp::Named("type") = "table",
+        Rcpp::Named("header") = header,
+        Rcpp::Named("data") = columns,
+        Rcpp::Named("colnames") = colnames
+      );
+      continue;
+    }
+    out[ii] = Rcpp::List::create(
+      Rcpp::Named("type") = "header",
+      Rcpp::Named("header") = header
+    );
+  }
+
+  if (cores > 1 && !images.empty()) {
+    auto bounds = split_img_reads(images, std::min<std::size_t>(cores, images.size()));
+    // no R API from here until all pixels are read
+    parallel_for(bounds.size() - 1, cores, [&](std::size_t gg) {
+      fits_file worker = fits_safe_open_file(name.c_str(), READONLY);
+      for (auto jj = bounds[gg]; jj < bounds[gg + 1]; jj++) {
+        int worker_hdutype;
+        fits_invoke(movabs_hdu, worker, images[jj].img.hdu, &worker_hdutype);
+        read_img_pixels(worker, images[jj].img);
+      }
+    });
+  }
+
+  for (auto &image : images) {
+    out[image.index] = Rcpp::List::create(
+      Rcpp::Named("type") = "image",
+      Rcpp::Named("header") = image.header,
+      Rcpp::Named("data") = finish_img_data(image.img, image.pixels),
+      Rcpp::Named("bitpix") = image.img.bitpix,
+      Rcpp::Named("naxes") = Rcpp::NumericVector(image.naxes.begin(), image.naxes.end())
+    );
+  }
+  return out;
+}
+
+/**
+ * Appends the HDU described by spec (one element of the list prepared by
+ * Rfits_write_all) to fptr and writes its header. first is set for the first
+ * HDU of a new file, where header only HDUs need an empty primary array.
+ */
+static void create_hdu_from_spec(fitsfile *fptr, Rcpp::List spec, bool first)
+{
+  std::string type = Rcpp::as<std::string>(spec["type"]);
+  fits_invoke(create_hdu, fptr);
+  if (type == "image") {
+    auto naxes = Rcpp::as<std::vector<long>>(spec["naxes"]);
+    std::string compress = Rcpp::as<std::string>(spec["compress"]);
+    if (!compress.empty()) {
+      fits_invoke(parse_compress_spec, fptr, const_cast<char *>(compress.c_str()));
+    }
+    fits_invoke(create_img, fptr, Rcpp::as<int>(spec["bitpix"]), naxes.size(), naxes.data());
+  }
+  else if (type == "table") {
+    auto ttypes = Rcpp::as<Rcpp::CharacterVector>(spec["ttypes"]);
+    auto tforms = Rcpp::as<Rcpp::CharacterVector>(spec["tforms"]);
+    auto tunits = Rcpp::as<Rcpp::CharacterVector>(spec["tunits"]);
+    auto c_ttypes = to_string_vector(ttypes);
+    auto c_tforms = to_string_vector(tforms);
+    auto c_tunits = to_string_vector(tunits);
+    std::string extname = Rcpp::as<std::string>(spec["extname"]);
+    fits_invoke(create_tbl, fptr, Rcpp::as<int>(spec["table_type"]), 0, ttypes.size(),
+                c_ttypes.data(), c_tforms.data(), c_tunits.data(), const_cast<char *>(extname.c_str()));
+  }
+  else if (first) {
+    long *axes = {0};
+    fits_invoke(create_img, fptr, 16, 0, axes);
+  }
+  write_header_keys(fptr, Rcpp::as<Rcpp::CharacterVector>(spec["keynames"]),
+                    Rcpp::as<Rcpp::List>(spec["keyvalues"]),
+                    Rcpp::as<Rcpp::CharacterVector>(spec["keycomments"]),
+                    Rcpp::as<Rcpp::IntegerVector>(spec["typecodes"]),
+                    Rcpp::as<Rcpp::CharacterVector>(spec["comment"]),
+                    Rcpp::as<Rcpp::CharacterVector>(spec["history"]),
+                    Rcpp::as<bool>(spec["skip_existing"]), true);
+}
+
+static pix_data spec_pix_data(Rcpp::List spec)
+{
+  auto naxes = Rcpp::as<std::vector<long>>(spec["naxes"]);
+  long nelements = 1;
+  for (auto naxisn : naxes) {
+    nelements *= naxisn;
+  }
+  return get_pix_data(spec["data"], Rcpp::as<int>(spec["datatype"]), naxes.size(), nelements);
+}
+
+/**
+ * Writes the data unit of the HDU described by spec into the current HDU of
+ * fptr, which was set up by create_hdu_from_spec.
+ */
+static void write_hdu_from_spec(fitsfile *fptr, Rcpp::List spec)
+{
+  std::string type = Rcpp::as<std::string>(spec["type"]);
+  if (type == "image") {
+    write_pix_data(fptr, spec_pix_data(spec));
+    if (!Rcpp::as<std::string>(spec["compress"]).empty()) {
+      // later images are not compressed unless they ask for it
+      fits_invoke(set_compression_type, fptr, 0);
+    }
+  }
+  else if (type == "table") {
+    auto columns = Rcpp::as<Rcpp::List>(spec["data"]);
+    auto coltypes = Rcpp::as<Rcpp::IntegerVector>(spec["coltypes"]);
+    int nrow = Rcpp::as<int>(spec["nrow"]);
+    for (R_xlen_t jj = 0; jj < columns.size(); jj++) {
+      write_col_data(fptr, columns[jj], nrow, jj + 1, coltypes[jj]);
+    }
+  }
+}
+
+/**
+ * Writes a whole list of HDUs (as prepared by Rfits_write_all) to a new file
+ * through a single handle, so cfitsio never re-opens the file or re-scans the
+ * HDUs already written. With cores > 1 the tile compressed images are first
+ * compressed in parallel into memory, and then copied across in order.
+ */
+// [[Rcpp::export]]
+void Cfits_write_all_hdus(Rcpp::String filename, Rcpp::List hdus, int cores=1)
+{
+  auto nhdu = hdus.size();
+  std::vector<fits_file> compressed(nhdu);
+
+  if (cores > 1) {
+    std::vector<std::size_t> todo;
+    std::vector<pix_data> pixels;
+    for (R_xlen_t ii = 0; ii < nhdu; ii++) {
+      auto spec = Rcpp::as<Rcpp::List>(hdus[ii]);
+      if (Rcpp::as<std::string>(spec["type"]) != "image" || Rcpp::as<std::string>(spec["compress"]).empty()) {
+        continue;
+      }
+      fits_invoke(create_file, compressed[ii], "mem://");
+      create_hdu_from_spec(compressed[ii], spec, true);
+      todo.push_back(ii);
+      pixels.push_back(spec_pix_data(spec));
+    }
+
+    // no R API from here until all images are compressed
+    parallel_for(todo.size(), cores, [&](std::size_t ii) {
+      write_pix_data(compressed[todo[ii]], pixels[ii]);
+      // settles the heap size (PCOUNT) so that copy_hdu takes the whole image
+      fits_invoke(flush_file, compressed[todo[ii]]);
+    });
+  }
+
+  fits_file fptr;
+  fits_invoke(create_file, fptr, filename.get_cstring());
+  for (R_xlen_t ii = 0; ii < nhdu; ii++) {
+    if (compressed[ii].m_fptr) {
+      if (ii == 0) {
+        // bring along the empty primary array cfitsio put in front of the image
+        fits_invoke(copy_file, compressed[ii], fptr, 1, 1, 0);
+      }
+      else {
+        fits_invoke(copy_hdu, compressed[ii], fptr, 0);
+      }
+      continue;
+    }
+    auto spec = Rcpp::as<Rcpp::List>(hdus[ii]);
+    create_hdu_from_spec(fptr, spec, ii == 0);
+    write_hdu_from_spec(fptr, spec);
+  }
+}
+
+static std::string upper_keyname(std::string keyname)
+{
+  std::transform(keyname.begin(), keyname.end(), keyname.begin(),
+                 [](unsigned char c) { return std::toupper(c); });
+  return keyname;
+}
+
+typedef std::unordered_map<std::string, std::size_t> header_key_positions;
+
+/**
+ * Indexes the key cards of a header by upper case keyname, mapping each to
+ * its card position. Only the keynames are read here, values are parsed as
+ * they are looked up (find_header_key). HIERARCH keys can be found both with
+ * and without their HIERARCH prefix. As with cfitsio, the first occurrence
+ * of a repeated key wins.
+ */
+static header_key_positions index_header_cards(const std::vector<std::string> &cards)
+{
+  header_key_positions keys;
+  keys.reserve(cards.size() * 2);
+  for (std::size_t ii = 0; ii < cards.size(); ii++) {
+    const auto &card = cards[ii];
+    if (is_comment_card(card) || is_history_card(card)) {
+      continue;
+    }
+    auto eq = header_card_equals(card);
+    if (eq == std::string::npos) {
+      continue;
+    }
+    auto keyname = upper_keyname(trim_blanks(card.substr(0, eq)));
+    if (keyname.compare(0, 8, "HIERARCH") == 0) {
+      keys.emplace(trim_blanks(keyname.substr(8)), ii);
+    }
+    keys.emplace(std::move(keyname), ii);
+  }
+  return keys;
+}
+
+// the parsed key, with type 0 if it is not in the header
+static header_card find_header_key(const std::vector<std::string> &cards, const header_key_positions &keys,
+                                   const std::string &keyname)
+{
+  auto key = keys.find(keyname);
+  if (key == keys.end()) {
+    return header_card();
+  }
+  return parse_header_card(cards[key->second]);
+}
+
+static Rcpp::List lookup_header_keys(const std::vector<std::string> &cards, const header_key_positions &keys,
+                                     const Rcpp::CharacterVector &keynames)
+{
+  Rcpp::List out(keynames.size());
+  for (R_xlen_t ii = 0; ii < keynames.size(); ii++) {
+    auto key = find_header_key(cards, keys, upper_keyname(Rcpp::as<std::string>(keynames[ii])));
+    if (!key.type) {
+      out[ii] = Rcpp::LogicalVector::create(NA_LOGICAL);
+    }
+    else {
+      out[ii] = header_card_value(key);
+    }
+  }
+  out.attr("names") = keynames;
+  return out;
+}
+
+// [[Rcpp::export]]
+Rcpp::List Cfits_read_keys(Rcpp::String filename, Rcpp::CharacterVector keynames, int ext=1){
+  int nkeys;
+  auto cards = read_file_header_cards(filename.get_cstring(), ext, nkeys);
+  return lookup_header_keys(cards, index_header_cards(cards), keynames);
+}
+
+/**
+ * A header held natively as its raw cards plus a hashed keyword index. Key
+ * values are parsed as they are looked up, and the full Rfits_header list is
+ * only built the first time it is asked for, and is then kept alongside the
+ * cards.
+ */
+struct header_index {
+  std::vector<std::string> cards;
+  int nkeys = 0;
+  header_key_positions keys;
+  Rcpp::RObject parsed;
+};
+
+static header_index &get_header_index(SEXP index)
+{
+  Rcpp::XPtr<header_index> ptr(index);
+  if (!ptr.get()) {
+    throw std::runtime_error("Header index is no longer valid (was it saved and reloaded?)");
+  }
+  return *ptr.get();
+}
+
+// [[Rcpp::export]]
+SEXP Cfits_header_index(Rcpp::String filename, int ext=1){
+  int nkeys;
+  auto cards = read_file_header_cards(filename.get_cstring(), ext, nkeys);
+  
+  std::unique_ptr<header_index> index(new header_index());
+  index->cards = std::move(cards);
+  index->nkeys = nkeys;
+  index->keys = index_header_cards(index->cards);
+  return Rcpp::XPtr<header_index>(index.release(), true);
+}
+
+// [[Rcpp::export]]
+bool Cfits_header_index_valid(SEXP index){
+  return Rcpp::XPtr<header_index>(index).get() != nullptr;
+}
+
+// [[Rcpp::export]]
+Rcpp::List Cfits_header_index_keys(SEXP index, Rcpp::CharacterVector keynames){
+  auto &header = get_header_index(index);
+  return lookup_header_keys(header.cards, header.keys, keynames);
+}
+
+// [[Rcpp::export]]
+SEXP Cfits_header_index_list(SEXP index){
+  auto &header = get_header_index(index);
+  if (header.parsed.isNULL()) {
+    header.parsed = header_cards_to_list(header.cards, header.nkeys, false);
+  }
+  return header.parsed;
+}
+
+/**
+ * Keys extracted by the key scan for a single file. Cards with type 0 are
+ * missing (or unreadable) and end up as NA.
+ */
+struct key_scan_row {
+  std::vector<header_card> keys;
+  int length = NA_INTEGER;
+  int dims[4] = {NA_INTEGER, NA_INTEGER, NA_INTEGER, NA_INTEGER};
+};
+
+static void key_scan_file(const std::string &filename, int ext, const std::string &extname,
+                          const std::vector<std::string> &keynames, key_scan_row &row)
+{
+  int nkeys, hdutype;
+  row.keys.resize(keynames.size());
+  fits_file fptr = fits_safe_open_file(filename.c_str(), READONLY);
+  if (extname.empty()) {
+    fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  }
+  else {
+    fits_invoke(movnam_hdu, fptr, ANY_HDU, const_cast<char *>(extname.c_str()), 0);
+  }
+  auto cards = read_header_cards(fptr, nkeys);
+  auto keys = index_header_cards(cards);
+
+  for (std::size_t ii = 0; ii < keynames.size(); ii++) {
+    auto key = find_header_key(cards, keys, keynames[ii]);
+    if (key.type != 'N') {
+      row.keys[ii] = key;
+    }
+  }
+
+  row.length = std::count_if(cards.begin(), cards.end(), [](const std::string &card) {
+    return !is_comment_card(card) && !is_history_card(card) && header_card_equals(card) != std::string::npos;
+  });
+
+  // same convention as dim.Rfits_keylist: ZNAXISn for tile compressed images
+  auto zimage = find_header_key(cards, keys, "ZIMAGE");
+  bool compressed = zimage.type == 'L' && zimage.logical;
+  for (int jj = 0; jj < 4; jj++) {
+    auto dim = find_header_key(cards, keys, (compressed ? "ZNAXIS" : "NAXIS") + std::to_string(jj + 1));
+    if (dim.type == 'I') {
+      row.dims[jj] = dim.ivalue;
+    }
+  }
+}
+
+/**
+ * Builds one typed column out of the idx-th key of every row: integer,
+ * double or logical when all present values agree, character otherwise.
+ */
+static SEXP key_scan_column(const std::vector<key_scan_row> &rows, std::size_t idx)
+{
+  bool all_int = true, all_num = true, all_lgl = true;
+  for (const auto &row : rows) {
+    char type = row.keys[idx].type;
+    if (!type) {
+      continue;
+    }
+    all_int = all_int && type == 'I';
+    all_num = all_num && (type == 'I' || type == 'F');
+    all_lgl = all_lgl && type == 'L';
+  }
+
+  auto nrow = rows.size();
+  if (all_int) {
+    Rcpp::IntegerVector out(nrow, NA_INTEGER);
+    for (std::size_t ii = 0; ii < nrow; ii++) {
+      if (rows[ii].keys[idx].type) {
+        out[ii] = rows[ii].keys[idx].ivalue;
+      }
+    }
+    return out;
+  }
+  if (all_num) {
+    Rcpp::NumericVector out(nrow, NA_REAL);
+    for (std::size_t ii = 0; ii < nrow; ii++) {
+      const auto &key = rows[ii].keys[idx];
+      if (key.type) {
+        out[ii] = key.type == 'I' ? key.ivalue : key.dvalue;
+      }
+    }
+    return out;
+  }
+  if (all_lgl) {
+    Rcpp::LogicalVector out(nrow, NA_LOGICAL);
+    for (std::size_t ii = 0; ii < nrow; ii++) {
+      if (rows[ii].keys[idx].type) {
+        out[ii] = rows[ii].keys[idx].logical;
+      }
+    }
+    return out;
+  }
+  Rcpp::CharacterVector out(nrow, NA_STRING);
+  for (std::size_t ii = 0; ii < nrow; ii++) {
+    if (rows[ii].keys[idx].type) {
+      out[ii] = rows[ii].keys[idx].value;
+    }
+  }
+  return out;
+}
+
+// [[Rcpp::export]]
+Rcpp::List Cfits_key_scan(Rcpp::CharacterVector filelist, Rcpp::IntegerVector extlist,
+                          Rcpp::CharacterVector extnames, Rcpp::CharacterVector keylist,
+                          int get_length=0, int get_dim=0, int cores=1){
+  auto filenames = Rcpp::as<std::vector<std::string>>(filelist);
+  auto nfile = filenames.size();
+  std::vector<int> exts(extlist.begin(), extlist.end());
+  std::vector<std::string> names(nfile);
+  for (std::size_t ii = 0; ii < nfile; ii++) {
+    if (extnames[ii] != NA_STRING) {
+      names[ii] = Rcpp::as<std::string>(extnames[ii]);
+    }
+  }
+  auto keynames = Rcpp::as<std::vector<std::string>>(keylist);
+  for (auto &keyname : keynames) {
+    keyname = upper_keyname(keyname);
+  }
+
+  // no R API from here until all files are scanned
+  std::vector<key_scan_row> rows(nfile);
+  parallel_for(nfile, cores, [&](std::size_t ii) {
+    try {
+      key_scan_file(filenames[ii], exts[ii], names[ii], keynames, rows[ii]);
+    } catch (const std::runtime_error &e) {
+      // unreadable files or extensions give a row of NAs, as Rfits_read_key did
+      rows[ii] = key_scan_row();
+      rows[ii].keys.resize(keynames.size());
+      fits_clear_errmsg();
+    }
+  });
+
+  Rcpp::List out;
+  Rcpp::CharacterVector colnames;
+  for (std::size_t jj = 0; jj < keynames.size(); jj++) {
+    out.push_back(key_scan_column(rows, jj));
+    colnames.push_back(keylist[jj]);
+  }
+  if (get_length == 1) {
+    Rcpp::IntegerVector length(nfile);
+    for (std::size_t ii = 0; ii < nfile; ii++) {
+      length[ii] = rows[ii].length;
+    }
+    out.push_back(length);
+    colnames.push_back("length");
+  }
+  if (get_dim == 1) {
+    for (int jj = 0; jj < 4; jj++) {
+      Rcpp::IntegerVector dim(nfile);
+      for (std::size_t ii = 0; ii < nfile; ii++) {
+        dim[ii] = rows[ii].dims[jj];
+      }
+      out.push_back(dim);
+      colnames.push_back("dim_" + std::to_string(jj + 1));
+    }
+  }
+  out.attr("names") = colnames;
+  out.attr("class") = "data.frame";
+  out.attr("row.names") = Rcpp::IntegerVector::create(NA_INTEGER, -static_cast<int>(nfile));
+  return out;
+}
+
+// [[Rcpp::export]]
+SEXP Cfits_read_header_list(Rcpp::String filename, int ext=1, int remove_HIERARCH=0){
+  int nkeys;
+  auto cards = read_file_header_cards(filename.get_cstring(), ext, nkeys);
+  return header_cards_to_list(cards, nkeys, remove_HIERARCH == 1);
+}
+
+// [[Rcpp::export]]
+SEXP Cfits_parse_header(Rcpp::CharacterVector header, int nkey, int remove_HIERARCH=0){
+  auto cards = Rcpp::as<std::vector<std::string>>(header);
+  return header_cards_to_list(cards, nkey, remove_HIERARCH == 1);
+}
+
+// [[Rcpp::export]]
+void Cfits_delete_HDU(Rcpp::String filename, int ext=1){
+  int hdutype;
+  fits_file fptr;
+  fits_invoke(open_image, fptr, filename.get_cstring(), READWRITE);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  fits_invoke(delete_hdu, fptr, &hdutype);
+}
+
+// [[Rcpp::export]]
+void Cfits_delete_key(Rcpp::String filename, Rcpp::String keyname, int ext=1){
+  int hdutype;
+  fits_file fptr;
+  fits_invoke(open_image, fptr, filename.get_cstring(), READWRITE);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  fits_invoke(delete_key, fptr, keyname.get_cstring());
+}
+
+// [[Rcpp::export]]
+void Cfits_delete_header(Rcpp::String filename, int ext=1){
+  int hdutype, nkeys, keypos, ii;
+  fits_file fptr;
+  fits_invoke(open_image, fptr, filename.get_cstring(), READWRITE);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  fits_invoke(get_hdrpos, fptr, &nkeys, &keypos);
+  // deleting from the end means no later records have to be shifted up
+  for (ii = nkeys; ii >= 2; ii--)  {
+    fits_invoke(delete_record, fptr, ii);
+  }
+}
+
+/**
+ * Cards for a header edit, formatted by cfitsio itself in an empty in-memory
+ * header: every key (a long string followed by its CONTINUE cards), then the
+ * COMMENT, HISTORY and DATE cards, in the order they are written. Keys that
+ * cfitsio refuses are added to failed.
+ */
+static std::vector<std::string> format_header_cards(Rcpp::CharacterVector keynames, Rcpp::List keyvalues,
+                                                    Rcpp::CharacterVector keycomments, Rcpp::IntegerVector typecodes,
+                                                    Rcpp::CharacterVector comment, Rcpp::CharacterVector history,
+                                                    bool write_date, std::vector<std::string> &failed)
+{
+  int nkeys;
+  fits_file scratch;
+  fits_invoke(create_file, scratch, "mem://");
+  for (R_xlen_t ii = 0; ii < keynames.size(); ii++) {
+    std::string keyname = Rcpp::as<std::string>(keynames[ii]);
+    try {
+      update_key_value(scratch, keyvalues[ii], keyname.c_str(),
+                       Rcpp::as<std::string>(keycomments[ii]).c_str(), typecodes[ii]);
+    } catch (const std::runtime_error &e) {
+      fits_clear_errmsg();
+      failed.push_back(keyname);
+    }
+  }
+  for (R_xlen_t ii = 0; ii < comment.size(); ii++) {
+    fits_invoke(write_comment, scratch, Rcpp::as<std::string>(comment[ii]).c_str());
+  }
+  for (R_xlen_t ii = 0; ii < history.size(); ii++) {
+    fits_invoke(write_history, scratch, Rcpp::as<std::string>(history[ii]).c_str());
+  }
+  if (write_date) {
+    fits_invoke(write_date, scratch);
+  }
+  return read_header_cards(scratch, nkeys);
+}
+
+static bool is_continue_card(const std::string &card)
+{
+  return card.compare(0, 8, "CONTINUE") == 0;
+}
+
+/**
+ * Edits the header of the current HDU in one go. The new header is put
+ * together in memory from the existing cards, less the deleted keys and with
+ * the keys in edits replaced where they stand (the rest of edits goes at the
+ * end), and then written back in a single pass over the header records, with
+ * any missing header blocks inserted up front. extra records are reserved
+ * for cards cfitsio adds afterwards.
+ */
+static void rewrite_header(fitsfile *fptr, const std::vector<std::string> &delete_keynames,
+                           const std::vector<std::string> &edits, long extra)
+{
+  int nkeys, nexist, nmore;
+
+  // the key carried by a card (bare of any HIERARCH prefix), or empty for commentary cards
+  auto card_keyname = [](const std::string &card) {
+    char name[FLEN_KEYWORD];
+    int namelen = 0, status = 0;
+    if (is_comment_card(card) || is_history_card(card) || is_continue_card(card) ||
+        fits_get_keyname(const_cast<char *>(card.c_str()), name, &namelen, &status) || namelen == 0) {
+      return std::string();
+    }
+    auto keyname = upper_keyname(name);
+    return keyname.compare(0, 8, "HIERARCH") == 0 ? trim_blanks(keyname.substr(8)) : keyname;
+  };
+
+  // first record of every named key, found in a single header pass
+  std::unordered_map<std::string, std::size_t> positions;
+  auto cards = read_header_cards(fptr, nkeys);
+  for (std::size_t ii = 0; ii < cards.size(); ii++) {
+    auto keyname = card_keyname(cards[ii]);
+    if (!keyname.empty()) {
+      positions.emplace(keyname, ii);
+    }
+  }
+  fits_clear_errmsg();
+
+  std::vector<char> dropped(cards.size(), 0);
+  // drops the key at pos along with the CONTINUE cards of a long string value
+  auto drop_key = [&](std::size_t pos) {
+    dropped[pos] = 1;
+    for (auto ii = pos + 1; ii < cards.size() && is_continue_card(cards[ii]); ii++) {
+      dropped[ii] = 1;
+    }
+  };
+  for (const auto &keyname : delete_keynames) {
+    auto bare = upper_keyname(keyname);
+    if (bare.compare(0, 8, "HIERARCH") == 0) {
+      bare = trim_blanks(bare.substr(8));
+    }
+    auto found = positions.find(bare);
+    if (found != positions.end()) {
+      drop_key(found->second);
+      positions.erase(found);
+    }
+  }
+
+  std::map<std::size_t, std::vector<std::string>> replaced;
+  std::vector<std::string> appended;
+  for (std::size_t ii = 0; ii < edits.size(); ii++) {
+    auto keyname = card_keyname(edits[ii]);
+    auto found = keyname.empty() ? positions.end() : positions.find(keyname);
+    auto &target = found == positions.end() ? appended : replaced[found->second];
+    if (found != positions.end()) {
+      drop_key(found->second);
+    }
+    target.push_back(edits[ii]);
+    for (; ii + 1 < edits.size() && is_continue_card(edits[ii + 1]); ii++) {
+      target.push_back(edits[ii + 1]);
+    }
+  }
+  fits_clear_errmsg();
+
+  std::vector<std::string> header;
+  header.reserve(cards.size() + appended.size());
+  for (std::size_t ii = 0; ii < cards.size(); ii++) {
+    auto found = replaced.find(ii);
+    if (found != replaced.end()) {
+      header.insert(header.end(), found->second.begin(), found->second.end());
+    }
+    else if (!dropped[ii]) {
+      header.push_back(cards[ii]);
+    }
+  }
+  header.insert(header.end(), appended.begin(), appended.end());
+
+  long nold = cards.size(), nnew = header.size();
+  fits_invoke(get_hdrspace, fptr, &nexist, &nmore);
+  if (nnew + extra > nexist + nmore) {
+    fits_invoke(insert_blocks, fptr, (nnew + extra - nexist - nmore + 35) / 36, 0);
+  }
+
+  // only the records that changed are touched, in order
+  for (long ii = 0; ii < std::min(nold, nnew); ii++) {
+    if (header[ii] != cards[ii]) {
+      fits_invoke(modify_record, fptr, ii + 1, header[ii].c_str());
+    }
+  }
+  for (long ii = nold; ii < nnew; ii++) {
+    fits_invoke(write_record, fptr, header[ii].c_str());
+  }
+  // a shorter header leaves records over at the end, deleted from the end so nothing shifts
+  for (long ii = nold; ii > nnew; ii--) {
+    fits_invoke(delete_record, fptr, ii);
+  }
+}
+
+// [[Rcpp::export]]
+void Cfits_edit_header(Rcpp::String filename, int ext, Rcpp::CharacterVector keynames,
+                       Rcpp::List keyvalues, Rcpp::CharacterVector keycomments,
+                       Rcpp::IntegerVector typecodes, Rcpp::CharacterVector delete_keynames,
+                       Rcpp::CharacterVector comment, Rcpp::CharacterVector history,
+                       int write_date=0, int write_chksum=0){
+  int hdutype;
+
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+
+  std::vector<std::string> failed;
+  auto edits = format_header_cards(keynames, keyvalues, keycomments, typecodes, comment, history,
+                                   write_date == 1, failed);
+  // CHECKSUM and DATASUM are written last by cfitsio, as they cover the rest of the header
+  rewrite_header(fptr, Rcpp::as<std::vector<std::string>>(delete_keynames), edits, write_chksum == 1 ? 2 : 0);
+  if (write_chksum == 1) {
+    fits_invoke(write_chksum, fptr);
+  }
+
+  if (!failed.empty()) {
+    std::ostringstream os;
+    os << "Failed to write " << failed.size() << " key(s):";
+    for (const auto &keyname : failed) {
+      os << " " << keyname;
+    }
+    Rcpp::warning(os.str());
+  }
+}
+/**
+ * An in-memory FITS file holding just the slab of a gzipped image HDU that a
+ * subset read needs, cut out using the gzip index. cfitsio keeps pointers to
+ * buffer and size, so this must outlive the fitsfile handle.
+ */
+struct gz_subset_file {
+  std::vector<char> data;
+  void *buffer = nullptr;
+  size_t size = 0;
+};
+
+static std::string fits_int_card(const std::string &keyname, long long value)
+{
+  char card[FLEN_CARD];
+  std::snprintf(card, sizeof(card), "%-8s= %20lld", keyname.c_str(), value);
+  return card;
+}
+
+/**
+ * Opens the rows fpixel..lpixel (along the last axis) of image HDU ext of an
+ * indexed gzip file as a primary image in memory, shifting fpixel and lpixel
+ * to match. Returns nullptr when there is no index for the file or the HDU is
+ * not a plain image, in which case the caller reads the file as usual.
+ */
+static fitsfile *open_gz_subset(const char *filename, int ext, long *fpixel, long *lpixel,
+                                gz_subset_file &subset)
+{
+  auto index = get_gz_index(filename);
+  if (!index) {
+    return nullptr;
+  }
+  int nkeys;
+  long long datastart;
+  auto cards = gz_read_header_cards(filename, ext, nkeys, datastart);
+
+  long long bitpix = 0, naxis = 0;
+  std::map<int, long long> naxes;
+  for (const auto &card : cards) {
+    auto key = parse_header_card(card);
+    if (key.keyname == "BITPIX") bitpix = key.ivalue;
+    else if (key.keyname == "NAXIS") naxis = key.ivalue;
+    else if (key.keyname == "ZIMAGE" || (key.keyname == "XTENSION" && key.value.find("IMAGE") == std::string::npos)) {
+      return nullptr;
+    }
+    else if (key.keyname.compare(0, 5, "NAXIS") == 0 && key.type == 'I') {
+      naxes[std::atoi(key.keyname.c_str() + 5)] = key.ivalue;
+    }
+  }
+  if (naxis < 1 || naxis > 4 || bitpix == 0) {
+    return nullptr;
+  }
+
+  int last = naxis - 1;
+  long long stride = std::abs(bitpix) / 8;
+  for (int ii = 1; ii < naxis; ii++) {
+    stride *= naxes[ii];
+  }
+  long long nrow = lpixel[last] - fpixel[last] + 1;
+  if (fpixel[last] < 1 || nrow < 1 || lpixel[last] > naxes[naxis]) {
+    return nullptr;
+  }
+
+  std::string naxis_last = "NAXIS" + std::to_string(naxis);
+  std::string header;
+  for (size_t ii = 0; ii < cards.size(); ii++) {
+    auto key = parse_header_card(cards[ii]);
+    std::string card = cards[ii];
+    if (ii == 0 && key.keyname == "XTENSION") {
+      card = "SIMPLE  =                    T";
+    }
+    else if (key.keyname == "PCOUNT" || key.keyname == "GCOUNT") {
+      continue;
+    }
+    else if (key.keyname == naxis_last) {
+      card = fits_int_card(naxis_last, nrow);
+    }
+    card.resize(80, ' ');
+    header += card;
+  }
+  header += std::string("END").append(77, ' ');
+  header.resize((header.size() + 2879) / 2880 * 2880, ' ');
+
+  long long nbytes = nrow * stride;
+  subset.data.assign(header.begin(), header.end());
+  subset.data.resize(header.size() + (nbytes + 2879) / 2880 * 2880, 0);
+  long long offset = datastart + (fpixel[last] - 1) * stride;
+  auto nread = gz_index_read(filename, *index, offset,
+                             reinterpret_cast<unsigned char *>(subset.data.data() + header.size()), nbytes);
+  if (static_cast<long long>(nread) != nbytes) {
+    throw std::runtime_error(std::string("Gzip file ended early while reading ") + filename);
+  }
+
+  fpixel[last] = 1;
+  lpixel[last] = nrow;
+
+  subset.buffer = subset.data.data();
+  subset.size = subset.data.size();
+  int status = 0;
+  fitsfile *fptr;
+  fits_open_memfile(&fptr, "gzsubset.fits", READONLY, &subset.buffer, &subset.size, 0, nullptr, &status);
+  if (status) {
+    throw fits_status_to_exception("open_memfile", status);
+  }
+  return fptr;
+}
+
+// [[Rcpp::export]]
+int Cfits_gzip_index(Rcpp::String filename, Rcpp::String index_file, double span=8388608){
+  auto index = std::make_shared<gz_index>(build_gz_index(filename.get_cstring(), static_cast<long long>(span)));
+  write_gz_index(*index, index_file.get_cstring());
+  std::lock_guard<std::mutex> lock(gz_index_mutex);
+  gz_index_cache[filename.get_cstring()] = index;
+  return index->points.size();
+}
+
+// [[Rcpp::export]]
+bool Cfits_gzip_index_load(Rcpp::String filename, Rcpp::String index_file){
+  struct stat st;
+  auto index = std::make_shared<gz_index>();
+  if (stat(filename.get_cstring(), &st) != 0 || !read_gz_index(index_file.get_cstring(), st, *index)) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(gz_index_mutex);
+  gz_index_cache[filename.get_cstring()] = index;
+  return true;
+}
+
+// [[Rcpp::export]]
+bool Cfits_gzip_index_available(Rcpp::String filename){
+  return get_gz_index(filename.get_cstring()) != nullptr;
+}
+
+// [[Rcpp::export]]
+SEXP Cfits_read_img_subset(Rcpp::String filename, int ext=1, int datatype= -32, 
+                           long fpixel0=1, long fpixel1=1, long fpixel2=1, long fpixel3=1,
+                           long lpixel0=100, long lpixel1=100, long lpixel2=1, long lpixel3=1,
+                           long sparse=1, int blank=0
+                           )
+{
+  int anynull, nullvals = 0, hdutype;
+  // BLANK pixels of integer images become NA as they are decoded
+  int inull = blank == 1 ? IMG_NA_INTEGER : 0;
+  LONGLONG llnull = blank == 1 ? IMG_NA_INTEGER64 : 0;
+  
+  long fpixel[] = {fpixel0, fpixel1, fpixel2, fpixel3};
+  long lpixel[] = {lpixel0, lpixel1, lpixel2, lpixel3};
+  
+  // indexed gzip files only inflate the rows the subset needs
+  gz_subset_file subset;
+  fitsfile *gz_fptr = nullptr;
+  if (is_gzip_filename(filename.get_cstring())) {
+    gz_fptr = open_gz_subset(filename.get_cstring(), ext, fpixel, lpixel, subset);
+  }
+  fits_file fptr = gz_fptr ? gz_fptr : fits_safe_open_file(filename.get_cstring(), READONLY);
+  if (!gz_fptr) {
+    fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  }
+  
+  int naxis1 = (lpixel[0] - fpixel[0] + 1);
+  int naxis2 = (lpixel[1] - fpixel[1] + 1);
+  int naxis3 = (lpixel[2] - fpixel[2] + 1);
+  int naxis4 = (lpixel[3] - fpixel[3] + 1);
+  
+  // Rcpp::Rcout << naxis1 << naxis2 << naxis3 << naxis4 <<"\n";
+  
+  if(sparse > 1){
+    if(naxis1 > 1){
+      naxis1 = 1 + floor((naxis1 - 1)/sparse);
+    }
+    
+    if(naxis2 > 1){
+      naxis2 = 1 + floor((naxis2 - 1)/sparse);
+    }
+    
+    if(naxis3 > 1){
+      naxis3 = 1 + floor((naxis3 - 1)/sparse);
+    }
+    
+    if(naxis4 > 1){
+      naxis4 = 1 + floor((naxis4 - 1)/sparse);
+    }
+  }
+  
+  int nelements = naxis1 * naxis2 * naxis3 * naxis4;
+  long inc[] = {sparse, sparse, sparse, sparse};
+  
+  // Rcpp::Rcout << nelements <<"\n";
+  // Rcpp::Rcout << inc <<"\n";
+  // Rcpp::Rcout << fpixel <<"\n";
+  // Rcpp::Rcout << lpixel <<"\n";
+  
+  if (datatype==FLOAT_IMG){
+    std::vector<float> pixels(nelements);
+    fits_invoke(read_subset, fptr, TFLOAT, fpixel, lpixel, inc,
+                  &nullvals, pixels.data(), &anynull);
+    Rcpp::NumericVector pixel_matrix(nelements);
+    std::copy(pixels.begin(), pixels.end(), pixel_matrix.begin());
+    return(pixel_matrix);
+  }else if (datatype==DOUBLE_IMG){
+    std::vector<double> pixels(nelements);
+    fits_invoke(read_subset, fptr, TDOUBLE, fpixel, lpixel, inc,
+                  &nullvals, pixels.data(), &anynull);
+    Rcpp::NumericVector pixel_matrix(nelements);
+    std::copy(pixels.begin(), pixels.end(), pixel_matrix.begin());
+    return(pixel_matrix);
+  }else if (datatype==BYTE_IMG || datatype==SHORT_IMG){
+    // read as int, straight into the output (unsigned shorts with BZERO do not fit a short)
+    Rcpp::IntegerVector pixel_matrix(nelements);
+    fits_invoke(read_subset, fptr, TINT, fpixel, lpixel, inc,
+                  &inull, pixel_matrix.begin(), &anynull);
+    return(pixel_matrix);
+  }else if (datatype==LONG_IMG){
+    std::vector<long> pixels(nelements);
+    long lnull = inull;
+    fits_invoke(read_subset, fptr, TLONG, fpixel, lpixel, inc,
+                  &lnull, pixels.data(), &anynull);
+    return long_img_output(pixels, anynull && blank == 1);
+  }else if (datatype==LONGLONG_IMG){
+    Rcpp::NumericVector pixel_matrix(nelements);
+    fits_invoke(read_subset, fptr, TLONGLONG, fpixel, lpixel, inc,
+                &llnull, reinterpret_cast<LONGLONG *>(pixel_matrix.begin()), &anynull);
+    pixel_matrix.attr("class") = "integer64";
+    return(pixel_matrix);
+  }
+  throw std::runtime_error("unsupported type");
+}
+
+// [[Rcpp::export]]
+void Cfits_write_img_subset(Rcpp::String filename, SEXP data, int ext=1, int datatype = -32, int naxis=2,
+                           long fpixel0=1, long fpixel1=1, long fpixel2=1, long fpixel3=1,
+                           long lpixel0=100, long lpixel1=100, long lpixel2=1, long lpixel3=1
+                             
+){
+  int anynull, nullvals = 0, hdutype, ii, nelements;
+  
+  // Rcpp::Rcout << filename.get_cstring() <<"\n";
+  // Rcpp::Rcout << datatype <<"\n";
+  // Rcpp::Rcout << naxis <<"\n";
+  
+  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
+  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
+  
+  long fpixel_vector[] = {fpixel0};
+  long fpixel_image[] = {fpixel0, fpixel1};
+  long fpixel_cube[] = {fpixel0, fpixel1, fpixel2};
+  long fpixel_array[] = {fpixel0, fpixel1, fpixel2, fpixel3};
+  long *fpixel = (naxis == 1) ? fpixel_vector : (naxis == 2) ? fpixel_image : (naxis == 3 ? fpixel_cube : fpixel_array);
+  
+  // Rcpp::Rcout << fpixel0 <<"\n";
+  // Rcpp::Rcout << fpixel1 <<"\n";
+  // Rcpp::Rcout << fpixel2 <<"\n";
+  // Rcpp::Rcout << fpixel3 <<"\n";
+  
+  long lpixel_vector[] = {lpixel0};
+  long lpixel_image[] = {lpixel0, lpixel1};
+  long lpixel_cube[] = {lpixel0, lpixel1, lpixel2};
+  long lpixel_array[] = {lpixel0, lpixel1, lpixel2, lpixel3};
+  long *lpixel = (naxis == 1) ? lpixel_vector : (naxis == 2) ? lpixel_image : (naxis == 3 ? lpixel_cube : lpixel_array);
+  
+  // Rcpp::Rcout << lpixel0 <<"\n";
+  // Rcpp::Rcout << lpixel1 <<"\n";
+  // Rcpp::Rcout << lpixel2 <<"\n";
+  // Rcpp::Rcout << lpixel3 <<"\n";
+  
+  int naxis1 = (lpixel[0] - fpixel[0] + 1);
+  int naxis2 = (lpixel[1] - fpixel[1] + 1);
+  int naxis3 = (lpixel[2] - fpixel[2] + 1);
+  int naxis4 = (lpixel[3] - fpixel[3] + 1);
+  
+  if(naxis == 1){
+    nelements = naxis1;
+  }
+  if(naxis == 2){
+    nelements = naxis1 * naxis2;
+  }
+  if(naxis == 3){
+    nelements = naxis1 * naxis2 * naxis3;
+  }
+  if(naxis == 4){
+    nelements = naxis1 * naxis2 * naxis3 * naxis4;
+  }
+  
+  // Rcpp::Rcout << nelements <<"\n";
+  
+  //below need to work for integers and doubles:
+  if(datatype == TBYTE){
+    // char *data_b = (char *)malloc(nelements * sizeof(char));
+    std::vector<Rbyte> data_b(nelements);
+    for (ii = 0; ii < nelements; ii++)  {
+      data_b[ii] = INTEGER(data)[ii];
+    }
+    fits_invoke(write_subset, fptr, datatype, fpixel, lpixel, data_b.data());
+  }else if(datatype == TINT){
+    fits_invoke(write_subset, fptr, datatype, fpixel, lpixel, INTEGER(data));
+  }else if(datatype == TSHORT){
+    // short *data_s = (short *)malloc(nelements * sizeof(short));
+    std::vector<short> data_s(nelements);
+    for (ii = 0; ii < nelements; ii++)  {
+      data_s[ii] = INTEGER(data)[ii];
+    } 
+    fits_invoke(write_subset, fptr, datatype, fpixel, lpixel, data_s.data());
+  }else if(datatype == TLONG){
+    // long *data_l = (long *)malloc(nelements * sizeof(long));
+    std::vector<long> data_l(nelements);
+    for (ii = 0; ii < nelements; ii++)  {
+      data_l[ii] = INTEGER(data)[ii];
+    }
+    fits_invoke(write_subset, fptr, datatype, fpixel, lpixel, data_l.data());
+  }else if(datatype == TLONGLONG){
+    fits_invoke(write_subset, fptr, datatype, fpixel, lpixel, REAL(data));
+  }else if(datatype == TDOUBLE){
+    fits_invoke(write_subset, fptr, datatype, fpixel, lpixel, REAL(data));
+  }else if(datatype == TFLOAT){
+    // float *data_f = (float *)malloc(nelements * sizeof(float));
+    std::vector<float> data_f(nelements);
+    for (ii = 0; ii < nelements; ii++)  {
+      data_f[ii] = REAL(data)[ii];
+    }
+    fits_invoke(write_subset, fptr, datatype, fpixel, lpixel, data_f.data());
+  }
+}
+
+/**
+ * Operations of an elementwise expression over image HDUs, as built by the
+ * Ops methods of Rfits_pointer and Rfits_lazy (and by Rfits_apply, whose
+ * expressions can also read images already in memory). Expressions arrive
+ * flattened in postfix order, with the R operator names as op codes.
+ */
+enum lazy_op {
+  LAZY_INPUT, LAZY_CONST, LAZY_MEMORY, LAZY_ADD, LAZY_SUB, LAZY_MUL, LAZY_DIV,
+  LAZY_POW, LAZY_MOD, LAZY_IDIV, LAZY_EQ, LAZY_NE, LAZY_LT, LAZY_LE, LAZY_GT,
+  LAZY_GE, LAZY_AND, LAZY_OR, LAZY_NEG, LAZY_NOT, LAZY_ABS, LAZY_SQRT, LAZY_EXP,
+  LAZY_LOG, LAZY_LOG10, LAZY_FLOOR, LAZY_CEILING
+};
+
+static const std::map<std::string, lazy_op> lazy_op_names = {
+  {"input", LAZY_INPUT}, {"const", LAZY_CONST}, {"memory", LAZY_MEMORY},
+  {"+", LAZY_ADD}, {"-", LAZY_SUB}, {"*", LAZY_MUL}, {"/", LAZY_DIV},
+  {"^", LAZY_POW}, {"%%", LAZY_MOD}, {"%/%", LAZY_IDIV}, {"==", LAZY_EQ},
+  {"!=", LAZY_NE}, {"<", LAZY_LT}, {"<=", LAZY_LE}, {">", LAZY_GT},
+  {">=", LAZY_GE}, {"&", LAZY_AND}, {"|", LAZY_OR}, {"neg", LAZY_NEG},
+  {"!", LAZY_NOT}, {"abs", LAZY_ABS}, {"sqrt", LAZY_SQRT}, {"exp", LAZY_EXP},
+  {"log", LAZY_LOG}, {"log10", LAZY_LOG10}, {"floor", LAZY_FLOOR},
+  {"ceiling", LAZY_CEILING}
+};
+
+static bool lazy_is_leaf(lazy_op op)
+{
+  return op == LAZY_INPUT || op == LAZY_CONST || op == LAZY_MEMORY;
+}
+
+static bool lazy_is_unary(lazy_op op)
+{
+  return op >= LAZY_NEG;
+}
+
+static bool lazy_is_logical(lazy_op op)
+{
+  return (op >= LAZY_EQ && op <= LAZY_OR) || op == LAZY_NOT;
+}
+
+// pixels evaluated per block, per input
+static const long LAZY_BLOCK = 65536;
+
+/**
+ * Pixels of an R vector read in place. Only the data pointers are kept, so
+ * workers never touch the R API; integer and logical NA become NaN as read.
+ */
+struct lazy_memory {
+  const double *real = nullptr;
+  const int *integer = nullptr;
+};
+
+struct lazy_program {
+  std::vector<lazy_op> ops;
+  std::vector<double> args;
+  std::vector<std::string> files;
+  std::vector<int> exts;
+  std::vector<lazy_memory> memory;
+  std::vector<long> naxes;
+  LONGLONG nelements = 1;
+  double na = 0;
+  int na_integer = 0;
+  bool logical = false;
+  // map BLANK (and NaN) pixels of the inputs to NaN while reading
+  bool blank = false;
+};
+
+static lazy_program get_lazy_program(Rcpp::List program)
+{
+  lazy_program prog;
+  auto ops = Rcpp::as<std::vector<std::string>>(program["ops"]);
+  prog.args = Rcpp::as<std::vector<double>>(program["args"]);
+  prog.files = Rcpp::as<std::vector<std::string>>(program["files"]);
+  prog.exts = Rcpp::as<std::vector<int>>(program["exts"]);
+  prog.naxes = Rcpp::as<std::vector<long>>(program["dim"]);
+  prog.blank = Rcpp::as<bool>(program["blank"]);
+  prog.na = NA_REAL;
+  prog.na_integer = NA_INTEGER;
+  if (ops.empty() || ops.size() != prog.args.size()) {
+    throw std::runtime_error("Malformed lazy expression");
+  }
+  for (auto naxis : prog.naxes) {
+    prog.nelements *= naxis;
+  }
+
+  auto memory = Rcpp::as<Rcpp::List>(program["memory"]);
+  for (R_xlen_t ii = 0; ii < memory.size(); ii++) {
+    SEXP values = memory[ii];
+    if (Rf_xlength(values) != prog.nelements) {
+      throw std::runtime_error("Image in memory does not match the dimensions of the lazy expression");
+    }
+    lazy_memory input;
+    switch (TYPEOF(values)) {
+    case REALSXP: input.real = REAL(values); break;
+    case INTSXP: input.integer = INTEGER(values); break;
+    case LGLSXP: input.integer = LOGICAL(values); break;
+    default:
+      throw std::runtime_error("Images in memory must be numeric, integer or logical");
+    }
+    prog.memory.push_back(input);
+  }
+
+  std::size_t depth = 0;
+  for (std::size_t ii = 0; ii < ops.size(); ii++) {
+    auto op = lazy_op_names.find(ops[ii]);
+    if (op == lazy_op_names.end()) {
+      throw std::runtime_error("Unsupported lazy operation " + ops[ii]);
+    }
+    prog.ops.push_back(op->second);
+    if (op->second == LAZY_INPUT || op->second == LAZY_MEMORY) {
+      auto ninput = op->second == LAZY_INPUT ? prog.files.size() : prog.memory.size();
+      if (prog.args[ii] < 0 || prog.args[ii] >= ninput) {
+        throw std::runtime_error("Malformed lazy expression");
+      }
+      depth++;
+    }
+    else if (op->second == LAZY_CONST) {
+      depth++;
+    }
+    else if (!lazy_is_unary(op->second)) {
+      if (depth < 2) {
+        throw std::runtime_error("Malformed lazy expression");
+      }
+      depth--;
+    }
+    else if (depth < 1) {
+      throw std::runtime_error("Malformed lazy expression");
+    }
+  }
+  if (depth != 1) {
+    throw std::runtime_error("Malformed lazy expression");
+  }
+  prog.logical = lazy_is_logical(prog.ops.back());
+  return prog;
+}
+
+/**
+ * What one thread needs to evaluate a lazy_program block by block: its own
+ * handle on every input, opened on first use, and a stack of block buffers.
+ */
+struct lazy_worker {
+  std::vector<fits_file> handles;
+  // whether each input holds integers, the only pixels with BLANK values
+  std::vector<char> integer;
+  std::vector<std::vector<double>> stack;
+
+  // nulval for reading input ii, mapping BLANK to NaN if blank is set; cfitsio
+  // would also turn floating point infinities into nulval, so those are left alone
+  double *nulval(std::size_t ii, bool blank)
+  {
+    static double nan = std::numeric_limits<double>::quiet_NaN();
+    return blank && integer[ii] ? &nan : nullptr;
+  }
+};
+
+static void lazy_open_inputs(const lazy_program &prog, lazy_worker &worker)
+{
+  int hdutype, naxis, bitpix;
+  worker.handles.resize(prog.files.size());
+  worker.integer.resize(prog.files.size());
+  for (std::size_t ii = 0; ii < prog.files.size(); ii++) {
+    auto &fptr = worker.handles[ii];
+    fptr = fits_safe_open_file(prog.files[ii].c_str(), READONLY);
+    fits_invoke(movabs_hdu, fptr, prog.exts[ii], &hdutype);
+    fits_invoke(get_img_type, fptr, &bitpix);
+    worker.integer[ii] = bitpix > 0;
+    fits_invoke(get_img_dim, fptr, &naxis);
+    std::vector<LONGLONG> naxes(naxis);
+    if (naxis > 0) {
+      fits_invoke(get_img_sizell, fptr, naxis, naxes.data());
+    }
+    LONGLONG nelements = naxis > 0 ? 1 : 0;
+    for (auto n : naxes) {
+      nelements *= n;
+    }
+    if (nelements != prog.nelements) {
+      throw std::runtime_error("Image in " + prog.files[ii] + " does not match the dimensions of the lazy expression");
+    }
+  }
+}
+
+template <typename F>
+static void lazy_apply(double *x, const double *y, long n, F &&f)
+{
+  for (long ii = 0; ii < n; ii++) {
+    x[ii] = f(x[ii], y[ii]);
+  }
+}
+
+/**
+ * Elementwise x = x op y with R semantics: comparisons and logical operators
+ * give 0/1 with NA for missing values (bar the short cuts of & and |).
+ */
+static void lazy_binary(lazy_op op, double *x, const double *y, long n, double na)
+{
+  auto compare = [na](double a, double b, bool result) {
+    return std::isnan(a) || std::isnan(b) ? na : double(result);
+  };
+  switch (op) {
+  case LAZY_ADD: lazy_apply(x, y, n, [](double a, double b) { return a + b; }); break;
+  case LAZY_SUB: lazy_apply(x, y, n, [](double a, double b) { return a - b; }); break;
+  case LAZY_MUL: lazy_apply(x, y, n, [](double a, double b) { return a * b; }); break;
+  case LAZY_DIV: lazy_apply(x, y, n, [](double a, double b) { return a / b; }); break;
+  case LAZY_POW:
+    lazy_apply(x, y, n, [](double a, double b) { return a == 1 || b == 0 ? 1 : std::pow(a, b); });
+    break;
+  case LAZY_MOD:
+    lazy_apply(x, y, n, [](double a, double b) { return b == 0 ? std::numeric_limits<double>::quiet_NaN() : a - std::floor(a / b) * b; });
+    break;
+  case LAZY_IDIV: lazy_apply(x, y, n, [](double a, double b) { return std::floor(a / b); }); break;
+  case LAZY_EQ: lazy_apply(x, y, n, [&](double a, double b) { return compare(a, b, a == b); }); break;
+  case LAZY_NE: lazy_apply(x, y, n, [&](double a, double b) { return compare(a, b, a != b); }); break;
+  case LAZY_LT: lazy_apply(x, y, n, [&](double a, double b) { return compare(a, b, a < b); }); break;
+  case LAZY_LE: lazy_apply(x, y, n, [&](double a, double b) { return compare(a, b, a <= b); }); break;
+  case LAZY_GT: lazy_apply(x, y, n, [&](double a, double b) { return compare(a, b, a > b); }); break;
+  case LAZY_GE: lazy_apply(x, y, n, [&](double a, double b) { return compare(a, b, a >= b); }); break;
+  case LAZY_AND:
+    lazy_apply(x, y, n, [na](double a, double b) {
+      return a == 0 || b == 0 ? 0 : (std::isnan(a) || std::isnan(b) ? na : 1);
+    });
+    break;
+  case LAZY_OR:
+    lazy_apply(x, y, n, [na](double a, double b) {
+      return (a != 0 && !std::isnan(a)) || (b != 0 && !std::isnan(b)) ? 1 : (std::isnan(a) || std::isnan(b) ? na : 0);
+    });
+    break;
+  default:
+    throw std::runtime_error("Unsupported lazy operation");
+  }
+}
+
+template <typename F>
+static void lazy_map(double *x, long n, F &&f)
+{
+  for (long ii = 0; ii < n; ii++) {
+    x[ii] = f(x[ii]);
+  }
+}
+
+/**
+ * Elementwise x = op x for the unary operations and functions.
+ */
+static void lazy_unary(lazy_op op, double *x, long n, double na)
+{
+  switch (op) {
+  case LAZY_NEG: lazy_map(x, n, [](double a) { return -a; }); break;
+  case LAZY_NOT: lazy_map(x, n, [na](double a) { return std::isnan(a) ? na : double(a == 0); }); break;
+  case LAZY_ABS: lazy_map(x, n, [](double a) { return std::fabs(a); }); break;
+  case LAZY_SQRT: lazy_map(x, n, [](double a) { return std::sqrt(a); }); break;
+  case LAZY_EXP: lazy_map(x, n, [](double a) { return std::exp(a); }); break;
+  case LAZY_LOG: lazy_map(x, n, [](double a) { return std::log(a); }); break;
+  case LAZY_LOG10: lazy_map(x, n, [](double a) { return std::log10(a); }); break;
+  case LAZY_FLOOR: lazy_map(x, n, [](double a) { return std::floor(a); }); break;
+  case LAZY_CEILING: lazy_map(x, n, [](double a) { return std::ceil(a); }); break;
+  default:
+    throw std::runtime_error("Unsupported lazy operation");
+  }
+}
+
+/**
+ * Evaluates pixels [first, first + n) of the expression, returning a pointer
+ * to the n results (valid until the worker's next block). Reads go through
+ * the worker's own handles, so workers can run on separate threads.
+ */
+static const double *lazy_eval_block(const lazy_program &prog, lazy_worker &worker, LONGLONG first, long n)
+{
+  if (worker.handles.size() != prog.files.size()) {
+    lazy_open_inputs(prog, worker);
+  }
+  std::size_t depth = 0;
+  for (std::size_t ii = 0; ii < prog.ops.size(); ii++) {
+    auto op = prog.ops[ii];
+    if (lazy_is_leaf(op)) {
+      if (worker.stack.size() <= depth) {
+        worker.stack.emplace_back();
+      }
+      auto &top = worker.stack[depth++];
+      top.resize(n);
+      if (op == LAZY_INPUT) {
+        int anynull;
+        std::size_t input = prog.args[ii];
+        fits_invoke(read_img, worker.handles[input], TDOUBLE, first + 1, n,
+                    worker.nulval(input, prog.blank), top.data(), &anynull);
+      }
+      else if (op == LAZY_MEMORY) {
+        auto &input = prog.memory[(std::size_t)prog.args[ii]];
+        if (input.real) {
+          std::copy(input.real + first, input.real + first + n, top.begin());
+        }
+        else {
+          auto values = input.integer + first;
+          for (long jj = 0; jj < n; jj++) {
+            top[jj] = values[jj] == prog.na_integer ? prog.na : values[jj];
+          }
+        }
+      }
+      else {
+        std::fill(top.begin(), top.end(), prog.args[ii]);
+      }
+    }
+    else if (lazy_is_unary(op)) {
+      lazy_unary(op, worker.stack[depth - 1].data(), n, prog.na);
+    }
+    else {
+      lazy_binary(op, worker.stack[depth - 2].data(), worker.stack[depth - 1].data(), n, prog.na);
+      depth--;
+    }
+  }
+  return worker.stack[0].data();
+}
+
+/**
+ * Workers for evaluating prog over nblock blocks on up to cores threads.
+ * Gzipped inputs would be inflated again by every handle, so they get one.
+ */
+static std::size_t lazy_nworker(const lazy_program &prog, std::size_t nblock, int cores)
+{
+  bool gzip = std::any_of(prog.files.begin(), prog.files.end(), is_gzip_filename);
+  return std::max<std::size_t>(1, std::min<std::size_t>(gzip ? 1 : std::max(cores, 1), nblock));
+}
+
+// [[Rcpp::export]]
+SEXP Cfits_lazy_eval(Rcpp::List program, int cores=1)
+{
+  auto prog = get_lazy_program(program);
+  std::size_t nblock = (prog.nelements + LAZY_BLOCK - 1) / LAZY_BLOCK;
+  std::size_t nworker = lazy_nworker(prog, nblock, cores);
+  std::vector<lazy_worker> workers(nworker);
+
+  Rcpp::NumericVector dout(prog.logical ? 0 : prog.nelements);
+  Rcpp::LogicalVector lout(prog.logical ? prog.nelements : 0);
+  double *dpixels = prog.logical ? nullptr : &(dout[0]);
+  int *lpixels = prog.logical ? &(lout[0]) : nullptr;
+  int na_logical = NA_LOGICAL;
+
+  // each worker takes a contiguous run of blocks, writing straight into the output
+  parallel_for(nworker, cores, [&](std::size_t ww) {
+    for (auto bb = nblock * ww / nworker; bb < nblock * (ww + 1) / nworker; bb++) {
+      LONGLONG first = (LONGLONG)bb * LAZY_BLOCK;
+      long n = std::min<LONGLONG>(LAZY_BLOCK, prog.nelements - first);
+      auto values = lazy_eval_block(prog, workers[ww], first, n);
+      if (lpixels) {
+        for (long ii = 0; ii < n; ii++) {
+          lpixels[first + ii] = std::isnan(values[ii]) ? na_logical : values[ii] != 0;
+        }
+      }
+      else {
+        std::copy(values, values + n, dpixels + first);
+      }
+    }
+  });
+
+  if (prog.logical) {
+    return lout;
+  }
+  return dout;
+}
+
+/**
+ * Running summary of evaluated pixels, ignoring NA/NaN.
+ */
+struct lazy_summary {
+  double sum = 0;
+  double min = std::numeric_limits<double>::infinity();
+  double max = -std::numeric_limits<double>::infinity();
+  LONGLONG count = 0;
+  LONGLONG nna = 0;
+
+  void add(const double *values, long n)
+  {
+    for (long ii = 0; ii < n; ii++) {
+      if (std::isnan(values[ii])) {
+        nna++;
+        continue;
+      }
+      sum += values[ii];
+      min = std::min(min, values[ii]);
+      max = std::max(max, values[ii]);
+      count++;
+    }
+  }
+
+  void add(const lazy_summary &other)
+  {
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    count += other.count;
+    nna += other.nna;
+  }
+};
+
+// [[Rcpp::export]]
+SEXP Cfits_lazy_reduce(Rcpp::List program, int cores=1)
+{
+  auto prog = get_lazy_program(program);
+  std::size_t nblock = (prog.nelements + LAZY_BLOCK - 1) / LAZY_BLOCK;
+  std::size_t nworker = lazy_nworker(prog, nblock, cores);
+  std::vector<lazy_worker> workers(nworker);
+  std::vector<lazy_summary> summaries(nworker);
+
+  parallel_for(nworker, cores, [&](std::size_t ww) {
+    for (auto bb = nblock * ww / nworker; bb < nblock * (ww + 1) / nworker; bb++) {
+      LONGLONG first = (LONGLONG)bb * LAZY_BLOCK;
+      long n = std::min<LONGLONG>(LAZY_BLOCK, prog.nelements - first);
+      summaries[ww].add(lazy_eval_block(prog, workers[ww], first, n), n);
+    }
+  });
+
+  lazy_summary total;
+  for (const auto &summary : summaries) {
+    total.add(summary);
+  }
+  return Rcpp::NumericVector::create(
+    Rcpp::Named("sum") = total.sum,
+    Rcpp::Named("mean") = total.count > 0 ? total.sum / total.count : R_NaN,
+    Rcpp::Named("min") = total.min,
+    Rcpp::Named("max") = total.max,
+    Rcpp::Named("count") = (double)total.count,
+    Rcpp::Named("nNA") = (double)total.nna
+  );
+}
+
+/**
+ * Writes a new image HDU of filename (with the dimensions of prog) block by
+ * block, in rounds of one block of block_size pixels per worker: the round
+ * is computed in parallel by eval(worker, first, n), which returns the n
+ * values, and then written in order. Returns the HDU number written.
+ */
+template <typename F>
+static int write_img_blocks(const lazy_program &prog, const char *filename, int bitpix, bool create_file,
+                            int cores, long block_size, F &&eval)
+{
+  std::size_t nblock = (prog.nelements + block_size - 1) / block_size;
+  std::size_t nworker = lazy_nworker(prog, nblock, cores);
+  std::vector<lazy_worker> workers(nworker);
+  std::vector<const double *> results(nworker);
+
+  fits_file fptr;
+  if (create_file) {
+    fits_invoke(create_file, fptr, filename);
+  }
+  else {
+    int nhdu, hdutype;
+    fptr = fits_safe_open_file(filename, READWRITE);
+    fits_invoke(get_num_hdus, fptr, &nhdu);
+    fits_invoke(movabs_hdu, fptr, nhdu, &hdutype);
+  }
+  std::vector<long> naxes = prog.naxes;
+  fits_invoke(create_img, fptr, bitpix, (int)naxes.size(), naxes.data());
+
+  for (std::size_t round = 0; round * nworker < nblock; round++) {
+    std::size_t nround = std::min(nworker, nblock - round * nworker);
+    parallel_for(nround, cores, [&](std::size_t ww) {
+      LONGLONG first = (LONGLONG)(round * nworker + ww) * block_size;
+      long n = std::min<LONGLONG>(block_size, prog.nelements - first);
+      results[ww] = eval(workers[ww], first, n);
+    });
+    for (std::size_t ww = 0; ww < nround; ww++) {
+      LONGLONG first = (LONGLONG)(round * nworker + ww) * block_size;
+      long n = std::min<LONGLONG>(block_size, prog.nelements - first);
+      fits_invoke(write_img, fptr, TDOUBLE, first + 1, n, const_cast<double *>(results[ww]));
+    }
+  }
+
+  int hdunum;
+  fits_get_hdu_num(fptr, &hdunum);
+  return hdunum;
+}
+
+/**
+ * Streams the evaluated expression into a new image HDU of filename.
+ */
+static int lazy_write(const lazy_program &prog, const char *filename, int bitpix, bool create_file, int cores)
+{
+  return write_img_blocks(prog, filename, bitpix, create_file, cores, LAZY_BLOCK,
+                          [&](lazy_worker &worker, LONGLONG first, long n) {
+    auto values = lazy_eval_block(prog, worker, first, n);
+    if (prog.logical) {
+      // BYTE images have no NA, so it is written as FALSE like Rfits_write_image does
+      auto &result = worker.stack[0];
+      std::replace_if(result.begin(), result.end(), [](double x) { return std::isnan(x); }, 0.0);
+    }
+    return values;
+  });
+}
+
+// [[Rcpp::export]]
+int Cfits_lazy_write(Rcpp::List program, Rcpp::String filename, int bitpix=-32, int create_file=1, int cores=1)
+{
+  return lazy_write(get_lazy_program(program), filename.get_cstring(), bitpix, create_file, cores);
+}
+
+/**
+ * A merging t-digest (after Dunning & Ertl) for streaming quantiles in
+ * bounded memory. Points are buffered and folded into at most ~compression
+ * centroids, sized by the arcsine scale function so the tails stay sharp.
+ */
+class tdigest {
+public:
+  explicit tdigest(double compression) : m_compression(compression) {}
+
+  void add(double x, double weight = 1)
+  {
+    m_buffer.push_back({x, weight});
+    m_min = std::min(m_min, x);
+    m_max = std::max(m_max, x);
+    if (m_buffer.size() >= 5 * m_compression) {
+      compress();
+    }
+  }
+
+  void merge(const tdigest &other)
+  {
+    for (const auto &c : other.m_centroids) {
+      add(c.mean, c.weight);
+    }
+    for (const auto &c : other.m_buffer) {
+      add(c.mean, c.weight);
+    }
+    m_min = std::min(m_min, other.m_min);
+    m_max = std::max(m_max, other.m_max);
+  }
+
+  double quantile(double q)
+  {
+    compress();
+    if (m_centroids.empty()) {
+      return std::numeric_limits<double>::quiet_NaN();
+    }
+    if (q <= 0) {
+      return m_min;
+    }
+    if (q >= 1) {
+      return m_max;
+    }
+    // interpolate between centroid centres, and out to min/max at the ends
+    double target = q * m_total;
+    double before = 0;
+    double prev_centre = 0, prev_mean = m_min;
+    for (const auto &c : m_centroids) {
+      double centre = before + c.weight / 2;
+      if (target < centre) {
+        double frac = (target - prev_centre) / (centre - prev_centre);
+        return prev_mean + frac * (c.mean - prev_mean);
+      }
+      before += c.weight;
+      prev_centre = centre;
+      prev_mean = c.mean;
+    }
+    double frac = (target - prev_centre) / (m_total - prev_centre);
+    return prev_mean + frac * (m_max - prev_mean);
+  }
+
+private:
+  struct centroid {
+    double mean;
+    double weight;
+  };
+
+  double k_to_q(double k) const
+  {
+    return (std::sin(std::min(std::max(k * 2 * M_PI / m_compression, -M_PI / 2), M_PI / 2)) + 1) / 2;
+  }
+
+  double q_to_k(double q) const
+  {
+    return m_compression / (2 * M_PI) * std::asin(2 * q - 1);
+  }
+
+  void compress()
+  {
+    if (m_buffer.empty()) {
+      return;
+    }
+    m_buffer.insert(m_buffer.end(), m_centroids.begin(), m_centroids.end());
+    std::sort(m_buffer.begin(), m_buffer.end(), [](const centroid &a, const centroid &b) { return a.mean < b.mean; });
+    m_total = 0;
+    for (const auto &c : m_buffer) {
+      m_total += c.weight;
+    }
+    m_centroids.clear();
+    auto current = m_buffer[0];
+    double so_far = 0;
+    double limit = m_total * k_to_q(q_to_k(0) + 1);
+    for (std::size_t ii = 1; ii < m_buffer.size(); ii++) {
+      const auto &next = m_buffer[ii];
+      if (so_far + current.weight + next.weight <= limit) {
+        current.mean += (next.mean - current.mean) * next.weight / (current.weight + next.weight);
+        current.weight += next.weight;
+      }
+      else {
+        so_far += current.weight;
+        m_centroids.push_back(current);
+        limit = m_total * k_to_q(q_to_k(so_far / m_total) + 1);
+        current = next;
+      }
+    }
+    m_centroids.push_back(current);
+    m_buffer.clear();
+  }
+
+  double m_compression;
+  double m_total = 0;
+  double m_min = std::numeric_limits<double>::infinity();
+  double m_max = -std::numeric_limits<double>::infinity();
+  std::vector<centroid> m_centroids;
+  std::vector<centroid> m_buffer;
+};
+
+/**
+ * Moments of the valid pixels of an image, accumulated block by block
+ * (two passes over each block, then merged with Chan et al.'s formula).
+ */
+struct image_stats {
+  LONGLONG count = 0;
+  LONGLONG nna = 0;
+  LONGLONG nmask = 0;
+  double sum = 0;
+  double mean = 0;
+  double m2 = 0;
+  double min = std::numeric_limits<double>::infinity();
+  double max = -std::numeric_limits<double>::infinity();
+
+  void add(const double *values, std::size_t n)
+  {
+    if (n == 0) {
+      return;
+    }
+    image_stats block;
+    std::size_t ii = 0;
+#if defined(__SSE2__)
+    // two pixels at a time, the lanes being combined at the end of each pass
+    double lanes[2];
+    __m128d vsum = _mm_setzero_pd();
+    __m128d vmin = _mm_set1_pd(block.min);
+    __m128d vmax = _mm_set1_pd(block.max);
+    for (; ii + 2 <= n; ii += 2) {
+      __m128d x = _mm_loadu_pd(values + ii);
+      vsum = _mm_add_pd(vsum, x);
+      vmin = _mm_min_pd(vmin, x);
+      vmax = _mm_max_pd(vmax, x);
+    }
+    _mm_storeu_pd(lanes, vsum);
+    block.sum = lanes[0] + lanes[1];
+    _mm_storeu_pd(lanes, vmin);
+    block.min = std::min(lanes[0], lanes[1]);
+    _mm_storeu_pd(lanes, vmax);
+    block.max = std::max(lanes[0], lanes[1]);
+#endif
+    for (; ii < n; ii++) {
+      block.sum += values[ii];
+      block.min = std::min(block.min, values[ii]);
+      block.max = std::max(block.max, values[ii]);
+    }
+    block.count = n;
+    block.mean = block.sum / n;
+    ii = 0;
+#if defined(__SSE2__)
+    __m128d vmean = _mm_set1_pd(block.mean);
+    __m128d vm2 = _mm_setzero_pd();
+    for (; ii + 2 <= n; ii += 2) {
+      __m128d d = _mm_sub_pd(_mm_loadu_pd(values + ii), vmean);
+      vm2 = _mm_add_pd(vm2, _mm_mul_pd(d, d));
+    }
+    _mm_storeu_pd(lanes, vm2);
+    block.m2 = lanes[0] + lanes[1];
+#endif
+    for (; ii < n; ii++) {
+      double d = values[ii] - block.mean;
+      block.m2 += d * d;
+    }
+    add(block);
+  }
+
+  void add(const image_stats &other)
+  {
+    nna += other.nna;
+    nmask += other.nmask;
+    if (other.count == 0) {
+      return;
+    }
+    double n = count + other.count;
+    double delta = other.mean - mean;
+    m2 += other.m2 + delta * delta * count * other.count / n;
+    mean += delta * other.count / n;
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    count += other.count;
+  }
+};
+
+/**
+ * Streams the pixels of prog through image_stats and a t-digest, on up to
+ * cores threads each taking a contiguous run of blocks. Pixels that are NA
+ * (or NaN), or non-zero in input mask_index (if >= 0), are left out.
+ */
+static void lazy_stats(const lazy_program &prog, int mask_index, int cores, image_stats &stats, tdigest &digest)
+{
+  std::size_t nblock = (prog.nelements + LAZY_BLOCK - 1) / LAZY_BLOCK;
+  std::size_t nworker = lazy_nworker(prog, nblock, cores);
+  std::vector<lazy_worker> workers(nworker);
+  std::vector<image_stats> partial(nworker);
+  std::vector<tdigest> digests(nworker, digest);
+
+  parallel_for(nworker, cores, [&](std::size_t ww) {
+    std::vector<double> mask, valid;
+    for (auto bb = nblock * ww / nworker; bb < nblock * (ww + 1) / nworker; bb++) {
+      LONGLONG first = (LONGLONG)bb * LAZY_BLOCK;
+      long n = std::min<LONGLONG>(LAZY_BLOCK, prog.nelements - first);
+      auto values = lazy_eval_block(prog, workers[ww], first, n);
+      if (mask_index >= 0) {
+        int anynull;
+        mask.resize(n);
+        fits_invoke(read_img, workers[ww].handles[mask_index], TDOUBLE, first + 1, n, nullptr, mask.data(), &anynull);
+      }
+      valid.clear();
+      for (long ii = 0; ii < n; ii++) {
+        if (mask_index >= 0 && mask[ii] != 0) {
+          partial[ww].nmask++;
+        }
+        else if (std::isnan(values[ii])) {
+          partial[ww].nna++;
+        }
+        else {
+          valid.push_back(values[ii]);
+          digests[ww].add(values[ii]);
+        }
+      }
+      partial[ww].add(valid.data(), valid.size());
+    }
+  });
+
+  for (std::size_t ww = 0; ww < nworker; ww++) {
+    stats.add(partial[ww]);
+    digest.merge(digests[ww]);
+  }
+}
+
+// [[Rcpp::export]]
+SEXP Cfits_lazy_stats(Rcpp::List program, Rcpp::NumericVector probs, Rcpp::String mask_file="", int mask_ext=1,
+                      double compression=1000, int cores=1)
+{
+  auto prog = get_lazy_program(program);
+  int mask_index = -1;
+  std::string mask_name = mask_file.get_cstring();
+  if (!mask_name.empty()) {
+    mask_index = prog.files.size();
+    prog.files.push_back(mask_name);
+    prog.exts.push_back(mask_ext);
+  }
+
+  image_stats stats;
+  tdigest digest(compression);
+  lazy_stats(prog, mask_index, cores, stats, digest);
+
+  Rcpp::NumericVector quantiles(probs.size());
+  for (R_xlen_t ii = 0; ii < probs.size(); ii++) {
+    quantiles[ii] = stats.count > 0 ? digest.quantile(probs[ii]) : NA_REAL;
+  }
+  return Rcpp::List::create(
+    Rcpp::Named("N") = (double)stats.count,
+    Rcpp::Named("NA") = (double)stats.nna,
+    Rcpp::Named("masked") = (double)stats.nmask,
+    Rcpp::Named("sum") = stats.sum,
+    Rcpp::Named("mean") = stats.count > 0 ? stats.mean : NA_REAL,
+    Rcpp::Named("sd") = stats.count > 1 ? std::sqrt(stats.m2 / (stats.count - 1)) : NA_REAL,
+    Rcpp::Named("min") = stats.count > 0 ? stats.min : NA_REAL,
+    Rcpp::Named("max") = stats.count > 0 ? stats.max : NA_REAL,
+    Rcpp::Named("quantiles") = quantiles
+  );
+}
+
+enum stack_method { STACK_MEAN, STACK_MEDIAN, STACK_CLIPPED_MEAN, STACK_WEIGHTED };
+
+static double stack_median(double *values, std::size_t n)
+{
+  auto middle = values + n / 2;
+  std::nth_element(values, middle, values + n);
+  if (n % 2) {
+    return *middle;
+  }
+  return (*middle + *std::max_element(values, middle)) / 2;
+}
+
+/**
+ * Combines the n valid values (and weights) of one output pixel. Sigma
+ * clipping rejects values more than clip standard deviations from the
+ * median, with the deviation also taken about the median (so a single wild
+ * value cannot drag the centre along), repeating until nothing changes or
+ * iters is reached.
+ */
+static double stack_pixel(stack_method method, double *values, const double *weights, std::size_t n,
+                          double clip, int iters)
+{
+  if (n == 0) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  if (method == STACK_MEDIAN) {
+    return stack_median(values, n);
+  }
+  if (method == STACK_WEIGHTED) {
+    double sum = 0, wsum = 0;
+    for (std::size_t ii = 0; ii < n; ii++) {
+      sum += values[ii] * weights[ii];
+      wsum += weights[ii];
+    }
+    return sum / wsum;
+  }
+  if (method == STACK_CLIPPED_MEAN) {
+    for (int iter = 0; iter < iters && n > 2; iter++) {
+      double median = stack_median(values, n);
+      double ss = 0;
+      for (std::size_t ii = 0; ii < n; ii++) {
+        ss += (values[ii] - median) * (values[ii] - median);
+      }
+      double limit = clip * std::sqrt(ss / (n - 1));
+      auto kept = std::partition(values, values + n, [&](double x) { return std::abs(x - median) <= limit; }) - values;
+      if (kept == (std::ptrdiff_t)n || kept == 0) {
+        break;
+      }
+      n = kept;
+    }
+  }
+  return std::accumulate(values, values + n, 0.0) / n;
+}
+
+/**
+ * Stacks the images prog.files[0 .. ninput) pixel by pixel into a new image
+ * HDU of filename, block by block. mask_index[ii] is the index in prog.files
+ * of the mask of input ii (non-zero pixels are left out), or -1 for none.
+ * BLANK and NaN pixels are always left out, and pixels with no valid inputs
+ * are NaN. Each worker holds one block of every input and mask.
+ */
+static int stack_write(const lazy_program &prog, std::size_t ninput, const std::vector<int> &mask_index,
+                       stack_method method, const std::vector<double> &weights, double clip, int iters,
+                       const char *filename, int bitpix, bool create_file, int cores)
+{
+  // about 32MB of input pixels per worker, but at least a few rows at a time
+  long block_size = std::max<long>(4096, (1L << 22) / prog.files.size());
+
+  return write_img_blocks(prog, filename, bitpix, create_file, cores, block_size,
+                          [&](lazy_worker &worker, LONGLONG first, long n) {
+    if (worker.handles.empty()) {
+      lazy_open_inputs(prog, worker);
+      worker.stack.resize(prog.files.size() + 2);
+    }
+    auto &planes = worker.stack;
+    for (std::size_t ii = 0; ii < prog.files.size(); ii++) {
+      int anynull;
+      planes[ii].resize(n);
+      fits_invoke(read_img, worker.handles[ii], TDOUBLE, first + 1, n, worker.nulval(ii, ii < ninput),
+                  planes[ii].data(), &anynull);
+    }
+    auto &values = planes[prog.files.size()];
+    auto &pixel_weights = planes[prog.files.size() + 1];
+    // the block's output goes after the gathered values of one pixel
+    values.resize(ninput + n);
+    pixel_weights.resize(ninput);
+    double *output = values.data() + ninput;
+    for (long pp = 0; pp < n; pp++) {
+      std::size_t nvalid = 0;
+      for (std::size_t ii = 0; ii < ninput; ii++) {
+        double x = planes[ii][pp];
+        if (std::isnan(x) || (mask_index[ii] >= 0 && planes[mask_index[ii]][pp] != 0)) {
+          continue;
+        }
+        values[nvalid] = x;
+        pixel_weights[nvalid] = weights.empty() ? 1 : weights[ii];
+        nvalid++;
+      }
+      output[pp] = stack_pixel(method, values.data(), pixel_weights.data(), nvalid, clip, iters);
+    }
+    return (const double *)output;
+  });
+}
+
+// [[Rcpp::export]]
+int Cfits_stack(Rcpp::CharacterVector filenames, Rcpp::IntegerVector exts, Rcpp::CharacterVector mask_files,
+                Rcpp::IntegerVector mask_exts, Rcpp::NumericVector dim, Rcpp::String method,
+                Rcpp::NumericVector weights, Rcpp::String filename, double clip=3, int iters=5,
+                int bitpix=-32, int create_file=1, int cores=1)
+{
+  static const std::map<std::string, stack_method> methods = {
+    {"mean", STACK_MEAN}, {"median", STACK_MEDIAN}, {"clipped_mean", STACK_CLIPPED_MEAN}, {"weighted", STACK_WEIGHTED}
+  };
+  auto found = methods.find(method.get_cstring());
+  if (found == methods.end()) {
+    throw std::runtime_error(std::string("Unsupported stacking method ") + method.get_cstring());
+  }
+
+  lazy_program prog;
+  std::size_t ninput = filenames.size();
+  for (std::size_t ii = 0; ii < ninput; ii++) {
+    prog.files.push_back(Rcpp::as<std::string>(filenames[ii]));
+    prog.exts.push_back(exts[ii]);
+  }
+  std::vector<int> mask_index(ninput, -1);
+  for (std::size_t ii = 0; ii < ninput && ii < (std::size_t)mask_files.size(); ii++) {
+    std::string mask_file = Rcpp::as<std::string>(mask_files[ii]);
+    if (!mask_file.empty()) {
+      mask_index[ii] = prog.files.size();
+      prog.files.push_back(mask_file);
+      prog.exts.push_back(mask_exts[ii]);
+    }
+  }
+  for (auto naxis : dim) {
+    prog.naxes.push_back((long)naxis);
+    prog.nelements *= (long)naxis;
+  }
+  std::vector<double> stack_weights(weights.begin(), weights.end());
+  if (found->second == STACK_WEIGHTED && stack_weights.size() != ninput) {
+    throw std::runtime_error("weights must have one value per input image");
+  }
+
+  return stack_write(prog, ninput, mask_index, found->second, stack_weights, clip, iters,
+                     filename.get_cstring(), bitpix, create_file, cores);
+}
+
+/**
+ * Bounding box (0-based, inclusive) of the valid pixels of an image, over
+ * its first two axes. Empty while xlo > xhi.
+ */
+struct crop_box {
+  long xlo = std::numeric_limits<long>::max();
+  long xhi = -1;
+  long ylo = std::numeric_limits<long>::max();
+  long yhi = -1;
+
+  void add(const crop_box &other)
+  {
+    xlo = std::min(xlo, other.xlo);
+    xhi = std::max(xhi, other.xhi);
+    ylo = std::min(ylo, other.ylo);
+    yhi = std::max(yhi, other.yhi);
+  }
+};
+
+/**
+ * Streams whole rows of the image through the workers and finds the box of
+ * the pixels that are not NA (crop_na), not infinite (crop_inf) and not zero
+ * (crop_zero). Rows only need scanning in from each end until the first
+ * valid pixel, and planes of a cube fold onto the same rows.
+ */
+static crop_box crop_scan(const lazy_program &prog, bool crop_na, bool crop_inf, bool crop_zero, int cores)
+{
+  long nx = prog.naxes[0];
+  long ny = prog.naxes.size() > 1 ? prog.naxes[1] : 1;
+  LONGLONG nrow = prog.nelements / nx;
+  long rows_per_block = std::max<long>(1, LAZY_BLOCK / nx);
+  std::size_t nblock = (nrow + rows_per_block - 1) / rows_per_block;
+  std::size_t nworker = lazy_nworker(prog, nblock, cores);
+  std::vector<lazy_worker> workers(nworker);
+  std::vector<crop_box> boxes(nworker);
+
+  auto valid = [&](double x) {
+    return !((crop_na && std::isnan(x)) || (crop_inf && !std::isfinite(x)) || (crop_zero && x == 0));
+  };
+#if defined(__SSE2__)
+  // whether neither of the two pixels at x is valid, so scans can step over invalid pixels in pairs
+  const __m128d sign = _mm_set1_pd(-0.0);
+  const __m128d inf = _mm_set1_pd(std::numeric_limits<double>::infinity());
+  auto invalid_pair = [&](const double *x) {
+    __m128d v = _mm_loadu_pd(x);
+    __m128d bad = _mm_setzero_pd();
+    if (crop_na || crop_inf) {
+      bad = _mm_cmpunord_pd(v, v);
+    }
+    if (crop_inf) {
+      bad = _mm_or_pd(bad, _mm_cmpeq_pd(_mm_andnot_pd(sign, v), inf));
+    }
+    if (crop_zero) {
+      bad = _mm_or_pd(bad, _mm_cmpeq_pd(v, _mm_setzero_pd()));
+    }
+    return _mm_movemask_pd(bad) == 3;
+  };
+#endif
+
+  parallel_for(nworker, cores, [&](std::size_t ww) {
+    auto &box = boxes[ww];
+    for (auto bb = nblock * ww / nworker; bb < nblock * (ww + 1) / nworker; bb++) {
+      LONGLONG first_row = (LONGLONG)bb * rows_per_block;
+      long nrows = std::min<LONGLONG>(rows_per_block, nrow - first_row);
+      auto values = lazy_eval_block(prog, workers[ww], first_row * nx, nrows * nx);
+      for (long rr = 0; rr < nrows; rr++) {
+        const double *row = values + rr * nx;
+        long lo = 0;
+#if defined(__SSE2__)
+        while (lo + 2 <= nx && invalid_pair(row + lo)) {
+          lo += 2;
+        }
+#endif
+        while (lo < nx && !valid(row[lo])) {
+          lo++;
+        }
+        if (lo == nx) {
+          continue;
+        }
+        long hi = nx - 1;
+#if defined(__SSE2__)
+        while (hi - 1 > lo && invalid_pair(row + hi - 1)) {
+          hi -= 2;
+        }
+#endif
+        while (!valid(row[hi])) {
+          hi--;
+        }
+        long yy = (first_row + rr) % ny;
+        box.xlo = std::min(box.xlo, lo);
+        box.xhi = std::max(box.xhi, hi);
+        box.ylo = std::min(box.ylo, yy);
+        box.yhi = std::max(box.yhi, yy);
+      }
+    }
+  });
+
+  crop_box total;
+  for (const auto &box : boxes) {
+    total.add(box);
+  }
+  return total;
 }
 
 // [[Rcpp::export]]
-void Cfits_delete_key(Rcpp::String filename, Rcpp::String keyname, int ext=1){
-  int hdutype;
-  fits_file fptr;
-  fits_invoke(open_image, fptr, filename.get_cstring(), READWRITE);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-  fits_invoke(delete_key, fptr, keyname.get_cstring());
+Rcpp::IntegerVector Cfits_crop_box(Rcpp::String filename, Rcpp::NumericVector dim, int ext=1, int crop_na=1,
+                                   int crop_inf=0, int crop_zero=0, int cores=1)
+{
+  lazy_program prog;
+  prog.ops = {LAZY_INPUT};
+  prog.args = {0};
+  prog.files = {filename.get_cstring()};
+  prog.exts = {ext};
+  prog.blank = true;
+  for (auto naxis : dim) {
+    prog.naxes.push_back((long)naxis);
+    prog.nelements *= (long)naxis;
+  }
+
+  auto box = crop_scan(prog, crop_na, crop_inf, crop_zero, cores);
+  Rcpp::IntegerVector output(4, NA_INTEGER);
+  if (box.xlo <= box.xhi) {
+    output[0] = box.xlo + 1;
+    output[1] = box.xhi + 1;
+    output[2] = box.ylo + 1;
+    output[3] = box.yhi + 1;
+  }
+  return output;
 }
 
-// [[Rcpp::export]]
-void Cfits_delete_header(Rcpp::String filename, int ext=1){
-  int hdutype, nkeys, keypos, ii;
-  fits_file fptr;
-  fits_invoke(open_image, fptr, filename.get_cstring(), READWRITE);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-  fits_invoke(get_hdrpos, fptr, &nkeys, &keypos);
-  for (ii = 2; ii <= nkeys; ii++)  {
-    fits_invoke(delete_record, fptr, 2);
+/**
+ * Bins up to four table columns (or cfitsio expressions of them) of the table
+ * at fptr into a new image at histptr with cfitsio's histogramming (histo.c),
+ * which streams the rows through its iterator, so the table is never read
+ * into memory. Each axis gets bins[ii] bins of equal width from lo[ii] to
+ * hi[ii]; NaN ends come from the TLMINn/TLMAXn keys or else the range of the
+ * data (with the maximum included in the last bin), and are set on return.
+ * The filter, a cfitsio row expression, is folded into the weight expression.
+ */
+static std::vector<long> make_histogram(fitsfile *fptr, fitsfile *histptr, const std::vector<std::string> &cols,
+                                        const std::vector<double> &bins, std::vector<double> &lo,
+                                        std::vector<double> &hi, std::string weight, const std::string &filter,
+                                        int bitpix)
+{
+  int naxis = cols.size();
+  if (naxis < 1 || naxis > 4) {
+    throw std::runtime_error("Histograms need between 1 and 4 columns");
+  }
+
+  // plain column names are looked up as such, anything else is an expression
+  char colname[4][FLEN_VALUE] = {}, minname[4][FLEN_VALUE] = {}, maxname[4][FLEN_VALUE] = {};
+  char binname[4][FLEN_VALUE] = {};
+  char *colexpr[4] = {};
+  std::vector<std::string> exprs(cols);
+  double minin[4], maxin[4], binsizein[4];
+  for (int ii = 0; ii < naxis; ii++) {
+    std::strncpy(colname[ii], cols[ii].c_str(), 68);
+    if (!std::all_of(cols[ii].begin(), cols[ii].end(), [](char c) { return std::isalnum((unsigned char)c) || c == '_'; })) {
+      colexpr[ii] = &exprs[ii][0];
+    }
+    minin[ii] = std::isnan(lo[ii]) ? DOUBLENULLVALUE : lo[ii];
+    maxin[ii] = std::isnan(hi[ii]) ? DOUBLENULLVALUE : hi[ii];
+    // any non-integral bin size, so the ranges come back unshifted
+    binsizein[ii] = 0.5;
+  }
+
+  int colnum[4] = {}, datatypes[4] = {};
+  long haxes[4], repeat;
+  double amin[4], amax[4], binsize[4];
+  char *binexpr[4] = {colexpr[0], colexpr[1], colexpr[2], colexpr[3]};
+  std::vector<std::string> binexprs(naxis);
+  fits_invoke(calc_binningde, fptr, naxis, colname, colexpr, minin, maxin, binsizein, minname, maxname,
+              binname, colnum, datatypes, haxes, amin, amax, binsize, &repeat);
+
+  for (int ii = 0; ii < naxis; ii++) {
+    if (std::isnan(lo[ii]) && std::isnan(hi[ii]) && amin[ii] == amax[ii]) {
+      amin[ii] -= 0.5;
+      amax[ii] += 0.5;
+    }
+    if (!(amax[ii] > amin[ii]) || bins[ii] < 1) {
+      throw std::runtime_error("Histogram range of " + cols[ii] + " is empty");
+    }
+    haxes[ii] = (long)bins[ii];
+    binsize[ii] = (amax[ii] - amin[ii]) / haxes[ii];
+    if (std::isnan(hi[ii])) {
+      // cfitsio bins are [lo, hi), so clamp values on a data maximum into the
+      // last bin by binning them at its centre instead
+      std::ostringstream os;
+      os << std::setprecision(17) << "(" << cols[ii] << ") == " << amax[ii] << " ? "
+         << amax[ii] - binsize[ii] / 2 << " : (" << cols[ii] << ")";
+      binexprs[ii] = os.str();
+      binexpr[ii] = &binexprs[ii][0];
+    }
+    lo[ii] = amin[ii];
+    hi[ii] = amax[ii];
+    // double values stop cfitsio treating integer limits as bin centres
+    datatypes[ii] = TDOUBLE;
+  }
+
+  if (!filter.empty()) {
+    weight = "(" + filter + ") ? (" + (weight.empty() ? "1" : weight) + ") : 0";
   }
+
+  // the same steps as ffhist2e, but with our own bins
+  fits_invoke(create_img, histptr, bitpix, naxis, haxes);
+  fits_invoke(copy_pixlist2image, fptr, histptr, 9, naxis, colnum);
+  fits_invoke(write_keys_histoe, fptr, histptr, naxis, colnum, colname, colexpr);
+  fits_invoke(rebin_wcsd, histptr, naxis, amin, binsize);
+  fits_invoke(make_histde, fptr, histptr, datatypes, bitpix, naxis, haxes, colnum, binexpr, amin, amax,
+              binsize, weight.empty() ? 1.0 : DOUBLENULLVALUE, 0,
+              weight.empty() ? nullptr : &weight[0], 0, nullptr);
+  return std::vector<long>(haxes, haxes + naxis);
 }
 
 // [[Rcpp::export]]
-SEXP Cfits_read_img_subset(Rcpp::String filename, int ext=1, int datatype= -32, 
-                           long fpixel0=1, long fpixel1=1, long fpixel2=1, long fpixel3=1,
-                           long lpixel0=100, long lpixel1=100, long lpixel2=1, long lpixel3=1,
-                           long sparse=1
-                           )
+Rcpp::List Cfits_histogram(Rcpp::String filename, int ext, std::vector<std::string> cols,
+                           std::vector<double> bins, std::vector<double> lo, std::vector<double> hi,
+                           Rcpp::String weight="", Rcpp::String filter="", int bitpix=32)
 {
-  int anynull, nullvals = 0, hdutype;
-  
+  int hdutype, nkeys;
   fits_file fptr = fits_safe_open_file(filename.get_cstring(), READONLY);
   fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-  
-  long fpixel[] = {fpixel0, fpixel1, fpixel2, fpixel3};
-  long lpixel[] = {lpixel0, lpixel1, lpixel2, lpixel3};
-  
-  int naxis1 = (lpixel[0] - fpixel[0] + 1);
-  int naxis2 = (lpixel[1] - fpixel[1] + 1);
-  int naxis3 = (lpixel[2] - fpixel[2] + 1);
-  int naxis4 = (lpixel[3] - fpixel[3] + 1);
-  
-  // Rcpp::Rcout << naxis1 << naxis2 << naxis3 << naxis4 <<"\n";
-  
-  if(sparse > 1){
-    if(naxis1 > 1){
-      naxis1 = 1 + floor((naxis1 - 1)/sparse);
+  if (hdutype != BINARY_TBL && hdutype != ASCII_TBL) {
+    throw std::runtime_error("Histograms can only be made from table HDUs");
+  }
+
+  fits_file histptr;
+  fits_invoke(create_file, histptr, "mem://");
+  auto naxes = make_histogram(fptr, histptr, cols, bins, lo, hi, weight.get_cstring(), filter.get_cstring(), bitpix);
+  LONGLONG nelements = 1;
+  for (auto naxis : naxes) {
+    nelements *= naxis;
+  }
+
+  auto cards = read_header_cards(histptr, nkeys);
+  return Rcpp::List::create(
+    Rcpp::Named("data") = read_img_data(histptr, bitpix, nelements),
+    Rcpp::Named("header") = header_cards_to_list(cards, nkeys, false),
+    Rcpp::Named("naxes") = Rcpp::NumericVector(naxes.begin(), naxes.end()),
+    Rcpp::Named("lo") = Rcpp::NumericVector(lo.begin(), lo.end()),
+    Rcpp::Named("hi") = Rcpp::NumericVector(hi.begin(), hi.end())
+  );
+}
+
+/**
+ * Read-only view of the bytes of a whole FITS file. Plain files are mapped
+ * into memory, in-memory (rfitsraw://) files are used in place, and gzipped
+ * files are inflated into a private buffer.
+ */
+class fits_file_bytes {
+public:
+  explicit fits_file_bytes(const std::string &filename)
+  {
+    if (filename.compare(0, RAW_PREFIX.size(), RAW_PREFIX) == 0) {
+      std::lock_guard<std::recursive_mutex> lock(raw_mutex);
+      auto file = raw_files.find(raw_file_name(filename));
+      if (file == raw_files.end()) {
+        throw std::runtime_error("No in-memory FITS file called " + filename);
+      }
+      m_data = reinterpret_cast<const unsigned char *>(file->second.data());
+      m_size = file->second.size();
     }
-    
-    if(naxis2 > 1){
-      naxis2 = 1 + floor((naxis2 - 1)/sparse);
+    else if (is_gzip_filename(filename)) {
+      gzFile gz = gzopen(filename.c_str(), "rb");
+      if (!gz) {
+        throw std::runtime_error("Could not open gzip file " + filename);
+      }
+      gzbuffer(gz, 1 << 17);
+      int nread;
+      do {
+        m_buffer.resize(m_buffer.size() + (1 << 22));
+        nread = gzread(gz, m_buffer.data() + m_buffer.size() - (1 << 22), 1 << 22);
+        m_buffer.resize(m_buffer.size() - (1 << 22) + std::max(nread, 0));
+      } while (nread > 0);
+      gzclose(gz);
+      if (nread < 0) {
+        throw std::runtime_error("Could not inflate gzip file " + filename);
+      }
+      m_data = m_buffer.data();
+      m_size = m_buffer.size();
     }
-    
-    if(naxis3 > 1){
-      naxis3 = 1 + floor((naxis3 - 1)/sparse);
+    else {
+      int fd = open(filename.c_str(), O_RDONLY);
+      struct stat st;
+      if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+          close(fd);
+        }
+        throw std::runtime_error("Could not open " + filename);
+      }
+      m_size = st.st_size;
+#ifdef _WIN32
+      m_buffer.resize(m_size);
+      size_t done = 0;
+      while (done < m_size) {
+        auto nread = read(fd, m_buffer.data() + done, std::min<size_t>(m_size - done, 1 << 30));
+        if (nread <= 0) {
+          break;
+        }
+        done += nread;
+      }
+      m_size = done;
+      m_data = m_buffer.data();
+#else
+      if (m_size > 0) {
+        void *map = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+          close(fd);
+          throw std::runtime_error("Could not map " + filename);
+        }
+        madvise(map, m_size, MADV_SEQUENTIAL);
+        m_map = map;
+        m_data = static_cast<const unsigned char *>(map);
+      }
+#endif
+      close(fd);
     }
-    
-    if(naxis4 > 1){
-      naxis4 = 1 + floor((naxis4 - 1)/sparse);
+  }
+
+  ~fits_file_bytes()
+  {
+#ifndef _WIN32
+    if (m_map) {
+      munmap(m_map, m_size);
     }
+#endif
   }
-  
-  int nelements = naxis1 * naxis2 * naxis3 * naxis4;
-  long inc[] = {sparse, sparse, sparse, sparse};
-  
-  // Rcpp::Rcout << nelements <<"\n";
-  // Rcpp::Rcout << inc <<"\n";
-  // Rcpp::Rcout << fpixel <<"\n";
-  // Rcpp::Rcout << lpixel <<"\n";
-  
-  if (datatype==FLOAT_IMG){
-    std::vector<float> pixels(nelements);
-    fits_invoke(read_subset, fptr, TFLOAT, fpixel, lpixel, inc,
-                  &nullvals, pixels.data(), &anynull);
-    Rcpp::NumericVector pixel_matrix(nelements);
-    std::copy(pixels.begin(), pixels.end(), pixel_matrix.begin());
-    return(pixel_matrix);
-  }else if (datatype==DOUBLE_IMG){
-    std::vector<double> pixels(nelements);
-    fits_invoke(read_subset, fptr, TDOUBLE, fpixel, lpixel, inc,
-                  &nullvals, pixels.data(), &anynull);
-    Rcpp::NumericVector pixel_matrix(nelements);
-    std::copy(pixels.begin(), pixels.end(), pixel_matrix.begin());
-    return(pixel_matrix);
-  }else if (datatype==BYTE_IMG){
-    std::vector<char> pixels(nelements);
-    fits_invoke(read_subset, fptr, TBYTE, fpixel, lpixel, inc,
-                  &nullvals, pixels.data(), &anynull);
-    Rcpp::IntegerVector pixel_matrix(nelements);
-    std::copy(pixels.begin(), pixels.end(), pixel_matrix.begin());
-    return(pixel_matrix);
-  }else if (datatype==SHORT_IMG){
-    std::vector<short> pixels(nelements);
-    fits_invoke(read_subset, fptr, TSHORT, fpixel, lpixel, inc,
-                  &nullvals, pixels.data(), &anynull);
-    Rcpp::IntegerVector pixel_matrix(nelements);
-    std::copy(pixels.begin(), pixels.end(), pixel_matrix.begin());
-    return(pixel_matrix);
-  }else if (datatype==LONG_IMG){
-    std::vector<long> pixels(nelements);
-    fits_invoke(read_subset, fptr, TLONG, fpixel, lpixel, inc,
-                  &nullvals, pixels.data(), &anynull);
-    return ensure_lossless_32bit_int(pixels);
-  }else if (datatype==LONGLONG_IMG){
-    std::vector<int64_t> pixels(nelements);
-    fits_invoke(read_subset, fptr, TLONG, fpixel, lpixel, inc,
-                &nullvals, pixels.data(), &anynull);
-    Rcpp::NumericVector pixel_matrix(nelements);
-    std::memcpy(&(pixel_matrix[0]), &(pixels[0]), nelements * sizeof(double));
-    pixel_matrix.attr("class") = "integer64";
-    return(pixel_matrix);
+
+  fits_file_bytes(const fits_file_bytes &) = delete;
+  fits_file_bytes &operator=(const fits_file_bytes &) = delete;
+
+  const unsigned char *data() const { return m_data; }
+  size_t size() const { return m_size; }
+
+private:
+  const unsigned char *m_data = nullptr;
+  size_t m_size = 0;
+  void *m_map = nullptr;
+  std::vector<unsigned char> m_buffer;
+};
+
+/**
+ * Partial FITS checksum of nbytes (a multiple of 4) at buf. The high and low
+ * 16 bits of the big-endian 32-bit words are summed separately, as in
+ * cfitsio's ffcsum, and the result is only folded by checksum_fold. As the
+ * ones' complement sum is associative, partial sums of separate blocks can
+ * be added together (and folded) in any order.
+ */
+static uint64_t checksum_partial(const unsigned char *buf, size_t nbytes)
+{
+  uint64_t hi = 0, lo = 0;
+  size_t ii = 0;
+#if defined(__SSE2__)
+  // 16 bytes at a time: byte swap each 16 bit lane, then widen to 32 bits,
+  // giving lanes of (hi, lo, hi, lo). The 32 bit lanes are flushed before
+  // they can overflow.
+  const __m128i zero = _mm_setzero_si128();
+  while (nbytes - ii >= 16) {
+    __m128i acc = zero;
+    size_t stop = std::min(nbytes - (nbytes - ii) % 16, ii + 16 * 16384);
+    for (; ii < stop; ii += 16) {
+      __m128i words = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + ii));
+      words = _mm_or_si128(_mm_slli_epi16(words, 8), _mm_srli_epi16(words, 8));
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(words, zero));
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(words, zero));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc);
+    hi += static_cast<uint64_t>(lanes[0]) + lanes[2];
+    lo += static_cast<uint64_t>(lanes[1]) + lanes[3];
   }
-  throw std::runtime_error("unsupported type");
+#endif
+  for (; ii + 4 <= nbytes; ii += 4) {
+    hi += (buf[ii] << 8) | buf[ii + 1];
+    lo += (buf[ii + 2] << 8) | buf[ii + 3];
+  }
+  return (hi << 16) + lo;
 }
 
-// [[Rcpp::export]]
-void Cfits_write_img_subset(Rcpp::String filename, SEXP data, int ext=1, int datatype = -32, int naxis=2,
-                           long fpixel0=1, long fpixel1=1, long fpixel2=1, long fpixel3=1,
-                           long lpixel0=100, long lpixel1=100, long lpixel2=1, long lpixel3=1
-                             
-){
-  int anynull, nullvals = 0, hdutype, ii, nelements;
-  
-  // Rcpp::Rcout << filename.get_cstring() <<"\n";
-  // Rcpp::Rcout << datatype <<"\n";
-  // Rcpp::Rcout << naxis <<"\n";
-  
-  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
-  fits_invoke(movabs_hdu, fptr, ext, &hdutype);
-  
-  long fpixel_vector[] = {fpixel0};
-  long fpixel_image[] = {fpixel0, fpixel1};
-  long fpixel_cube[] = {fpixel0, fpixel1, fpixel2};
-  long fpixel_array[] = {fpixel0, fpixel1, fpixel2, fpixel3};
-  long *fpixel = (naxis == 1) ? fpixel_vector : (naxis == 2) ? fpixel_image : (naxis == 3 ? fpixel_cube : fpixel_array);
-  
-  // Rcpp::Rcout << fpixel0 <<"\n";
-  // Rcpp::Rcout << fpixel1 <<"\n";
-  // Rcpp::Rcout << fpixel2 <<"\n";
-  // Rcpp::Rcout << fpixel3 <<"\n";
-  
-  long lpixel_vector[] = {lpixel0};
-  long lpixel_image[] = {lpixel0, lpixel1};
-  long lpixel_cube[] = {lpixel0, lpixel1, lpixel2};
-  long lpixel_array[] = {lpixel0, lpixel1, lpixel2, lpixel3};
-  long *lpixel = (naxis == 1) ? lpixel_vector : (naxis == 2) ? lpixel_image : (naxis == 3 ? lpixel_cube : lpixel_array);
-  
-  // Rcpp::Rcout << lpixel0 <<"\n";
-  // Rcpp::Rcout << lpixel1 <<"\n";
-  // Rcpp::Rcout << lpixel2 <<"\n";
-  // Rcpp::Rcout << lpixel3 <<"\n";
-  
-  int naxis1 = (lpixel[0] - fpixel[0] + 1);
-  int naxis2 = (lpixel[1] - fpixel[1] + 1);
-  int naxis3 = (lpixel[2] - fpixel[2] + 1);
-  int naxis4 = (lpixel[3] - fpixel[3] + 1);
-  
-  if(naxis == 1){
-    nelements = naxis1;
-  }
-  if(naxis == 2){
-    nelements = naxis1 * naxis2;
+/** Folds the carries of a partial checksum back in, giving the 32 bit sum. */
+static uint32_t checksum_fold(uint64_t sum)
+{
+  while (sum >> 32) {
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
   }
-  if(naxis == 3){
-    nelements = naxis1 * naxis2 * naxis3;
+  return sum;
+}
+
+/**
+ * Computed checksums of one HDU, and how they compare with its DATASUM and
+ * CHECKSUM keywords (1 correct, 0 missing or blank, -1 incorrect), with the
+ * same meaning as cfitsio's fits_verify_chksum.
+ */
+struct hdu_checksum {
+  long long headstart = 0;
+  long long datastart = 0;
+  long long dataend = 0;
+  uint32_t datasum = 0;
+  uint32_t hdusum = 0;
+  int dataok = 0;
+  int hduok = 0;
+  std::string datasum_key;
+  bool has_checksum_key = false;
+};
+
+/**
+ * Computes the checksums of every HDU of the bytes of a FITS file in one
+ * pass. The headers are walked first, then the header and data units are
+ * split into chunks that are summed on up to cores threads, and the partial
+ * sums combined per HDU.
+ */
+static std::vector<hdu_checksum> checksum_hdus(const unsigned char *data, size_t size, int cores)
+{
+  std::vector<hdu_checksum> hdus;
+  long long offset = 0;
+  while (offset + 2880 <= static_cast<long long>(size)) {
+    // anything after the last HDU that is not another extension is ignored, as in cfitsio
+    if (!hdus.empty() && std::memcmp(data + offset, "XTENSION", 8) != 0) {
+      break;
+    }
+    hdu_checksum hdu;
+    hdu.headstart = offset;
+    std::vector<std::string> cards;
+    bool end = false;
+    while (!end) {
+      if (offset + 2880 > static_cast<long long>(size)) {
+        throw std::runtime_error("Reached the end of the file inside the header of HDU " + std::to_string(hdus.size() + 1));
+      }
+      for (int ii = 0; ii < 36 && !end; ii++) {
+        std::string card(reinterpret_cast<const char *>(data + offset) + ii * 80, 80);
+        if (card.compare(0, 8, "END     ") == 0) {
+          end = true;
+        }
+        else {
+          card.erase(card.find_last_not_of(' ') + 1);
+          if (card.compare(0, 8, "CHECKSUM") == 0 || card.compare(0, 8, "DATASUM ") == 0) {
+            auto key = parse_header_card(card);
+            if (key.keyname == "CHECKSUM") {
+              hdu.has_checksum_key = !key.value.empty();
+            }
+            else if (key.keyname == "DATASUM") {
+              hdu.datasum_key = key.value;
+            }
+          }
+          cards.push_back(card);
+        }
+      }
+      offset += 2880;
+    }
+    hdu.datastart = offset;
+    hdu.dataend = offset + header_data_size(cards);
+    if (hdu.dataend > static_cast<long long>(size)) {
+      throw std::runtime_error("Reached the end of the file inside the data of HDU " + std::to_string(hdus.size() + 1));
+    }
+    offset = hdu.dataend;
+    hdus.push_back(std::move(hdu));
   }
-  if(naxis == 4){
-    nelements = naxis1 * naxis2 * naxis3 * naxis4;
+  if (hdus.empty()) {
+    throw std::runtime_error("No FITS header found");
   }
-  
-  // Rcpp::Rcout << nelements <<"\n";
-  
-  //below need to work for integers and doubles:
-  if(datatype == TBYTE){
-    // char *data_b = (char *)malloc(nelements * sizeof(char));
-    std::vector<Rbyte> data_b(nelements);
-    for (ii = 0; ii < nelements; ii++)  {
-      data_b[ii] = INTEGER(data)[ii];
+
+  // chunks of whole blocks, big enough to keep the thread overhead small
+  const long long chunk_size = 2880LL * 2048;
+  struct chunk {
+    std::size_t hdu;
+    bool header;
+    long long start, end;
+    uint64_t sum;
+  };
+  std::vector<chunk> chunks;
+  for (std::size_t ii = 0; ii < hdus.size(); ii++) {
+    chunks.push_back(chunk {ii, true, hdus[ii].headstart, hdus[ii].datastart, 0});
+    for (long long start = hdus[ii].datastart; start < hdus[ii].dataend; start += chunk_size) {
+      chunks.push_back(chunk {ii, false, start, std::min(start + chunk_size, hdus[ii].dataend), 0});
     }
-    fits_invoke(write_subset, fptr, datatype, fpixel, lpixel, data_b.data());
-  }else if(datatype == TINT){
-    fits_invoke(write_subset, fptr, datatype, fpixel, lpixel, INTEGER(data));
-  }else if(datatype == TSHORT){
-    // short *data_s = (short *)malloc(nelements * sizeof(short));
-    std::vector<short> data_s(nelements);
-    for (ii = 0; ii < nelements; ii++)  {
-      data_s[ii] = INTEGER(data)[ii];
-    } 
-    fits_invoke(write_subset, fptr, datatype, fpixel, lpixel, data_s.data());
-  }else if(datatype == TLONG){
-    // long *data_l = (long *)malloc(nelements * sizeof(long));
-    std::vector<long> data_l(nelements);
-    for (ii = 0; ii < nelements; ii++)  {
-      data_l[ii] = INTEGER(data)[ii];
+  }
+  parallel_for(chunks.size(), cores, [&](std::size_t ii) {
+    chunks[ii].sum = checksum_partial(data + chunks[ii].start, chunks[ii].end - chunks[ii].start);
+  });
+
+  std::vector<uint64_t> headsums(hdus.size(), 0), datasums(hdus.size(), 0);
+  for (const auto &part : chunks) {
+    auto &total = part.header ? headsums[part.hdu] : datasums[part.hdu];
+    total = static_cast<uint64_t>(checksum_fold(total)) + checksum_fold(part.sum);
+  }
+  for (std::size_t ii = 0; ii < hdus.size(); ii++) {
+    auto &hdu = hdus[ii];
+    hdu.datasum = checksum_fold(datasums[ii]);
+    hdu.hdusum = checksum_fold(static_cast<uint64_t>(hdu.datasum) + checksum_fold(headsums[ii]));
+    if (!hdu.datasum_key.empty()) {
+      hdu.dataok = static_cast<uint32_t>(std::atof(hdu.datasum_key.c_str())) == hdu.datasum ? 1 : -1;
     }
-    fits_invoke(write_subset, fptr, datatype, fpixel, lpixel, data_l.data());
-  }else if(datatype == TLONGLONG){
-    fits_invoke(write_subset, fptr, datatype, fpixel, lpixel, REAL(data));
-  }else if(datatype == TDOUBLE){
-    fits_invoke(write_subset, fptr, datatype, fpixel, lpixel, REAL(data));
-  }else if(datatype == TFLOAT){
-    // float *data_f = (float *)malloc(nelements * sizeof(float));
-    std::vector<float> data_f(nelements);
-    for (ii = 0; ii < nelements; ii++)  {
-      data_f[ii] = REAL(data)[ii];
+    if (hdu.has_checksum_key) {
+      hdu.hduok = hdu.hdusum == 0 || hdu.hdusum == 0xFFFFFFFF ? 1 : -1;
     }
-    fits_invoke(write_subset, fptr, datatype, fpixel, lpixel, data_f.data());
   }
+  return hdus;
+}
+
+/** Unsigned sums as integer64, the way R has always received checksums. */
+static Rcpp::NumericVector checksum_integer64(const std::vector<unsigned long> &sums)
+{
+  Rcpp::NumericVector out(sums.size());
+  for (std::size_t ii = 0; ii < sums.size(); ii++) {
+    int64_t sum = sums[ii];
+    std::memcpy(&(out[ii]), &sum, 8);
+  }
+  out.attr("class") = "integer64";
+  return out;
 }
 
 // [[Rcpp::export]]
-void Cfits_write_chksum(Rcpp::String filename){
-  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
-  fits_invoke(write_chksum, fptr);
+Rcpp::DataFrame Cfits_checksum_hdus(Rcpp::String filename, int cores=1){
+  std::vector<hdu_checksum> hdus;
+  {
+    fits_file_bytes bytes(filename.get_cstring());
+    hdus = checksum_hdus(bytes.data(), bytes.size(), cores);
+  }
+  auto nhdu = hdus.size();
+  Rcpp::IntegerVector ext(nhdu), dataok(nhdu), hduok(nhdu);
+  std::vector<unsigned long> datasum(nhdu), hdusum(nhdu);
+  for (std::size_t ii = 0; ii < nhdu; ii++) {
+    ext[ii] = ii + 1;
+    dataok[ii] = hdus[ii].dataok;
+    hduok[ii] = hdus[ii].hduok;
+    datasum[ii] = hdus[ii].datasum;
+    hdusum[ii] = hdus[ii].hdusum;
+  }
+  return Rcpp::DataFrame::create(
+    Rcpp::Named("ext") = ext,
+    Rcpp::Named("dataok") = dataok,
+    Rcpp::Named("hduok") = hduok,
+    Rcpp::Named("datasum") = checksum_integer64(datasum),
+    Rcpp::Named("hdusum") = checksum_integer64(hdusum),
+    Rcpp::Named("stringsAsFactors") = false
+  );
 }
 
+/** Checksum results of one file for Cfits_verify_files. */
+struct file_checksums {
+  bool checked = false;
+  std::string error;
+  std::vector<hdu_checksum> hdus;
+};
+
 // [[Rcpp::export]]
-SEXP Cfits_verify_chksum(Rcpp::String filename, int verbose){
-  int dataok, hduok;
-  fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
-  fits_invoke(verify_chksum, fptr, &dataok, &hduok);
-  if(verbose == 1){
-    if(dataok == 1){
-      Rcpp::Rcout << "DATASUM is correct\n";
-    }
-    if(dataok == 0){
-      Rcpp::Rcout << "DATASUM is missing\n";
+Rcpp::DataFrame Cfits_verify_files(Rcpp::CharacterVector filenames, int cores=1, int stop_on_fail=0){
+  auto c_filenames = to_string_vector(filenames);
+  auto nfile = c_filenames.size();
+  std::vector<file_checksums> results(nfile);
+  std::atomic<bool> failed(false);
+  // spare threads go to summing within each file
+  int file_cores = std::max<int>(1, cores / std::max<std::size_t>(1, nfile));
+
+  parallel_for(nfile, cores, [&](std::size_t ii) {
+    if (stop_on_fail == 1 && failed) {
+      return;
     }
-    if(dataok == -1){
-      Rcpp::Rcout << "DATASUM is incorrect\n";
+    auto &result = results[ii];
+    result.checked = true;
+    try {
+      fits_file_bytes bytes(c_filenames[ii]);
+      result.hdus = checksum_hdus(bytes.data(), bytes.size(), file_cores);
+      for (const auto &hdu : result.hdus) {
+        if (hdu.dataok == -1 || hdu.hduok == -1) {
+          failed = true;
+        }
+      }
+    } catch (const std::exception &e) {
+      result.error = e.what();
+      failed = true;
     }
-    if(hduok == 1){
-      Rcpp::Rcout << "CHECKSUM is correct\n";
+  });
+
+  std::size_t nrow = 0;
+  for (const auto &result : results) {
+    nrow += result.checked ? std::max<std::size_t>(1, result.hdus.size()) : 0;
+  }
+  Rcpp::CharacterVector file(nrow), error(nrow);
+  Rcpp::IntegerVector ext(nrow), dataok(nrow), hduok(nrow);
+  std::size_t row = 0;
+  for (std::size_t ii = 0; ii < nfile; ii++) {
+    const auto &result = results[ii];
+    if (!result.checked) {
+      continue;
     }
-    if(hduok == 0){
-      Rcpp::Rcout << "CHECKSUM is missing\n";
+    if (!result.error.empty()) {
+      file[row] = c_filenames[ii];
+      ext[row] = NA_INTEGER;
+      dataok[row] = NA_INTEGER;
+      hduok[row] = NA_INTEGER;
+      error[row] = result.error;
+      row++;
+      continue;
     }
-    if(hduok == -1){
-      Rcpp::Rcout << "CHECKSUM is incorrect\n";
+    for (std::size_t jj = 0; jj < result.hdus.size(); jj++) {
+      file[row] = c_filenames[ii];
+      ext[row] = jj + 1;
+      dataok[row] = result.hdus[jj].dataok;
+      hduok[row] = result.hdus[jj].hduok;
+      error[row] = NA_STRING;
+      row++;
     }
   }
-  Rcpp::IntegerVector out(2);
-  out[0] = dataok;
-  out[1] = hduok;
-  return(out);
+
+  return Rcpp::DataFrame::create(
+    Rcpp::Named("file") = file,
+    Rcpp::Named("ext") = ext,
+    Rcpp::Named("dataok") = dataok,
+    Rcpp::Named("hduok") = hduok,
+    Rcpp::Named("error") = error,
+    Rcpp::Named("stringsAsFactors") = false
+  );
 }
 
 // [[Rcpp::export]]
-SEXP Cfits_get_chksum(Rcpp::String filename){
-  unsigned long datasum, hdusum;
+void Cfits_write_chksum(Rcpp::String filename){
   fits_file fptr = fits_safe_open_file(filename.get_cstring(), READWRITE);
-  fits_invoke(get_chksum, fptr, &datasum, &hdusum);
-  Rcpp::NumericVector out(2);
-  out.attr("class") = "integer64";
-  std::memcpy(&(out[0]), &datasum, 8);
-  std::memcpy(&(out[1]), &hdusum, 8);
-  return(out);
+  fits_invoke(write_chksum, fptr);
 }
 
 // [[Rcpp::export]]